@@ -6,7 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define max(a, b) ((a) <= (b) ? (a) : (b))
+#define max(a, b) ((a) >= (b) ? (a) : (b))
+#define min(a, b) ((a) <= (b) ? (a) : (b))
 
 void *malloc_checked(size_t size) {
   void *result = malloc(size);
@@ -31,13 +32,26 @@ buffer_t *buffer_alloc(size_t initial_size) {
   buff->data = malloc_checked(initial_size * sizeof *buff->data);
   buff->size = initial_size;
   buff->occupancy = 0;
+  buff->segmented = false;
+  buff->first_size = initial_size;
+  buff->segment_count = 1;
+  buff->segments[0] = buff->data;
+  return buff;
+}
+
+buffer_t *buffer_alloc_segmented(size_t first_size) {
+  assert (first_size > 0);
+
+  buffer_t *buff = buffer_alloc(first_size);
+  buff->segmented = true;
   return buff;
 }
 
 void buffer_free(buffer_t *buffer) {
   assert (buffer);
 
-  free(buffer->data);
+  for (size_t j = 0; j < buffer->segment_count; j++)
+    free(buffer->segments[j]);
   free(buffer);
 }
 
@@ -45,17 +59,49 @@ void buffer_resize(buffer_t *buff, size_t new_size) {
   assert (buff);
   assert (new_size >= buff->size);
 
-  unsigned char *new_data = malloc_checked(new_size);
-  memcpy(new_data, buff->data, buff->occupancy);
-  free(buff->data);
+  unsigned char *new_data = realloc(buff->data, new_size);
+  if (!new_data) {
+    perror("realloc()");
+    exit(EXIT_FAILURE);
+  }
   buff->data = new_data;
+  buff->segments[0] = new_data;
   buff->size = new_size;
 }
 
+/** Add the next segment of a segmented buffer */
+void buffer_grow(buffer_t *buff) {
+  size_t j = buff->segment_count;
+
+  assert (j < BUFFER_MAX_SEGMENTS);
+  buff->segments[j] = malloc_checked(buff->first_size << j);
+  buff->size += buff->first_size << j;
+  buff->segment_count++;
+}
+
 void buffer_write(buffer_t *buff, void *data, size_t data_size) {
   assert (buff);
-  if (buff->occupancy + data_size > buff->size)
-    buffer_resize(buff, max(buff->size + data_size, 2 * buff->size));
-  memcpy(buff->data + buff->occupancy, data, data_size);
-  buff->occupancy += data_size;
+
+  if (!buff->segmented) {
+    if (buff->occupancy + data_size > buff->size)
+      buffer_resize(buff, max(buff->occupancy + data_size, 2 * buff->size));
+    memcpy(buff->data + buff->occupancy, data, data_size);
+    buff->occupancy += data_size;
+    return;
+  }
+
+  /* Fill the current segment, then the next ones. */
+  unsigned char *src = data;
+  while (data_size) {
+    if (buff->occupancy == buff->size)
+      buffer_grow(buff);
+
+    size_t j = buffer_segment_index(buff, buff->occupancy);
+    size_t end = buffer_segment_start(buff, j) + (buff->first_size << j);
+    size_t n = min(data_size, end - buff->occupancy);
+    memcpy(buffer_at(buff, buff->occupancy), src, n);
+    buff->occupancy += n;
+    src += n;
+    data_size -= n;
+  }
 }
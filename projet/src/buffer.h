@@ -1,27 +1,77 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
-/* A simple type of append-only buffers. */
+/* A simple type of append-only buffers.
+
+   Contiguous buffers keep their contents in data, and double in size when
+   full. Segmented buffers never move their contents: they grow by adding
+   segments, the j-th one holding first_size << j bytes, so that appends are
+   O(1) without copying and offsets map to segments in O(1). Items whose size
+   divides first_size never straddle two segments. */
+
+#define BUFFER_MAX_SEGMENTS 48
 
 typedef struct buffer {
-  unsigned char *data;
+  unsigned char *data;                /* Contents, of contiguous buffers */
   size_t size;
   size_t occupancy;
+  bool segmented;
+  size_t first_size;                  /* Size of the first segment */
+  size_t segment_count;
+  unsigned char *segments[BUFFER_MAX_SEGMENTS];
 } buffer_t;
 
 void *malloc_checked(size_t size);
 char *strdup_checked(const char *);
 
 buffer_t *buffer_alloc(size_t initial_size);
+buffer_t *buffer_alloc_segmented(size_t first_size);
 void buffer_free(buffer_t *buff);
 
 void buffer_write(buffer_t *buff, void *data, size_t data_size);
 
-#define buffer_foreach(ty, var, buffer)                          \
-  for (ty *var = (ty *)buffer->data;                             \
-       var < (ty *)(buffer->data + buffer->occupancy);           \
-       var++)
+/** Offset of the first byte of segment j */
+static inline size_t buffer_segment_start(const buffer_t *buff, size_t j) {
+  return buff->segmented ? buff->first_size * (((size_t)1 << j) - 1) : 0;
+}
+
+/** Address past the last byte in use in segment j */
+static inline unsigned char *buffer_segment_end(const buffer_t *buff,
+                                                size_t j) {
+  size_t start = buffer_segment_start(buff, j);
+  size_t len = buff->segmented ? buff->first_size << j : buff->size;
+  size_t used = buff->occupancy > start ? buff->occupancy - start : 0;
+  return buff->segments[j] + (used < len ? used : len);
+}
+
+/** Segment holding the byte at offset in buff */
+static inline size_t buffer_segment_index(const buffer_t *buff,
+                                          size_t offset) {
+  if (!buff->segmented)
+    return 0;
+
+  size_t q = offset / buff->first_size + 1;
+  return 8 * sizeof(unsigned long long) - 1 - __builtin_clzll(q);
+}
+
+/** Address of the byte at offset in buff */
+static inline void *buffer_at(const buffer_t *buff, size_t offset) {
+  size_t j = buffer_segment_index(buff, offset);
+  return buff->segments[j] + offset - buffer_segment_start(buff, j);
+}
+
+/* Iterate over the items in each segment. The inner loop records whether its
+   body was entered, so that a break in the body also ends the outer one. */
+#define buffer_foreach(ty, var, buffer)                                 \
+  for (size_t var##_seg = 0, var##_brk = 0;                             \
+       !var##_brk && var##_seg < (buffer)->segment_count;               \
+       var##_seg++)                                                     \
+    for (ty *var = (ty *)(buffer)->segments[var##_seg];                 \
+         (unsigned char *)var < buffer_segment_end(buffer, var##_seg)   \
+           ? (var##_brk = 1) : (var##_brk = 0);                         \
+         var++, var##_brk = 0)
 
 #endif  /* BUFFER_H */
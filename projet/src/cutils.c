@@ -5,13 +5,19 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-log_verbosity_level level = LOG_INFO;
-FILE *f = NULL;
-char *filename = NULL;
+/* Each thread logs on its own behalf, see log_init(). */
+_Thread_local log_verbosity_level level = LOG_INFO;
+_Thread_local FILE *f = NULL;
+_Thread_local char *filename = NULL;
+
+/* The terminal is shared by all threads. */
+atomic_bool status_shown = false;
 
 void log_set_verbosity_level(log_verbosity_level l) {
   level = l;
@@ -24,6 +30,8 @@ void log_message_v(log_verbosity_level msg_level, const char *fmt, va_list va) {
   if (msg_level > level)
     return;
 
+  log_status_clear();
+
   va_copy(vb, va);
   if (f != NULL) {
     vfprintf(f, fmt, va);
@@ -40,6 +48,24 @@ void log_message(log_verbosity_level msg_level, const char *fmt, ...) {
   va_end(va);
 }
 
+void log_status(const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  printf("\r\e[?25l");  /* Disable cursor */
+  vprintf(fmt, va);
+  printf("\e[K\r\e[?25h");  /* Re-enable cursor */
+  fflush(stdout);
+  va_end(va);
+  atomic_store(&status_shown, true);
+}
+
+void log_status_clear() {
+  if (atomic_exchange(&status_shown, false)) {
+    printf("\r\e[K");
+    fflush(stdout);
+  }
+}
+
 void log_fatal(const char *fmt, ...) {
   va_list va;
   va_start(va, fmt);
@@ -77,12 +103,26 @@ void log_init(const char *fn) {
   log_info("[log] logging to %s\n", filename);
 }
 
+log_context_t log_context() {
+  log_context_t context = { f, level };
+  return context;
+}
+
+void log_adopt(log_context_t context) {
+  /* Without a filename, the file belongs to another thread. */
+  f = context.file;
+  level = context.level;
+}
+
 void log_shutdown() {
-  if (f) {
+  if (f && filename) {
     log_info("[log] shutting down, closing %s\n", filename);
     fclose(f);
     free(filename);
+    f = NULL;
+    filename = NULL;
   } else {
     log_info("[log] shutting down\n");
+    f = NULL;
   }
 }
@@ -5,6 +5,7 @@
 #define CUTILS_H
 
 #include <stdarg.h>
+#include <stdio.h>
 
 typedef enum {
   LOG_FATAL = 0,
@@ -14,15 +15,33 @@ typedef enum {
 
 /* Calling `log_init(fn)` initializes the logging subsystem, asking it to save
    log messages to the file `fn`. This pointer may be NULL, in which case the
-   messages are not saved. */
+   messages are not saved. The verbosity level and log file are specific to
+   the calling thread. */
 void log_init(const char *filename);
 void log_shutdown();
 
+/* Other threads of the same task, such as the renderer, log to the same file
+   at the same level by adopting the context of the thread which called
+   `log_init`. Only the latter closes the file, after the others are done. */
+typedef struct {
+  FILE *file;
+  log_verbosity_level level;
+} log_context_t;
+
+log_context_t log_context();
+void log_adopt(log_context_t context);
+
 void log_set_verbosity_level(log_verbosity_level level);
 
 void log_message_v(log_verbosity_level level, const char *fmt, va_list);
 void log_message(log_verbosity_level level, const char *fmt, ...);
 
+/* A status line may stay at the bottom of the terminal. Log messages erase it
+   before being printed, and it shows again on the next `log_status`. It is
+   never saved to the log file. */
+void log_status(const char *fmt, ...);
+void log_status_clear();
+
 void log_fatal(const char *fmt, ...);
 void log_info(const char *fmt, ...);
 void log_debug(const char *fmt, ...);
@@ -0,0 +1,301 @@
+#include "htrc.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HTRC_ZLIB
+#include <zlib.h>
+#endif
+
+#include "buffer.h"
+
+size_t htrc_put_varint(unsigned char *p, uint64_t v) {
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+typedef struct htrc_reader {
+  FILE *f;
+  bool failed;
+  trace_time_unit_t time_unit;
+  size_t time_unit_factor;
+  size_t signal_count;
+  char **names;
+  trace_signal_type_t *types;
+
+  /* Current block, decoded */
+  size_t first_cycle;
+  size_t cycles;
+  uint32_t *samples;                  /* signals x cycles samples */
+  bool *present;
+  size_t capacity;                    /* Cycles samples has room for */
+  unsigned char *raw, *stored;
+  size_t raw_size, stored_size;
+} htrc_reader_t;
+
+bool htrc_read_varint(FILE *f, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(f);
+    if (c == EOF)
+      return false;
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool htrc_get_varint(const unsigned char **p, const unsigned char *end,
+                     uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+    unsigned char c = *(*p)++;
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+htrc_reader_t *htrc_open(const char *file_name) {
+  assert (file_name);
+
+  FILE *f = fopen(file_name, "rb");
+  if (!f)
+    return NULL;
+
+  char magic[4];
+  int version = 0, unit = 0;
+  uint64_t factor, count;
+  if (fread(magic, 1, sizeof magic, f) != sizeof magic
+      || memcmp(magic, HTRC_MAGIC, sizeof magic)
+      || (version = getc(f)) != HTRC_VERSION
+      || (unit = getc(f)) == EOF || unit > TRACE_TIME_UNIT_FS
+      || !htrc_read_varint(f, &factor)
+      || !htrc_read_varint(f, &count) || count > HTRC_MAX_SIGNALS) {
+    fprintf(stderr, "[htrc] %s is not a version %d trace\n",
+            file_name, HTRC_VERSION);
+    fclose(f);
+    return NULL;
+  }
+
+  htrc_reader_t *r = malloc_checked(sizeof *r);
+  memset(r, 0, sizeof *r);
+  r->f = f;
+  r->time_unit = unit;
+  r->time_unit_factor = factor;
+  r->names = calloc(count + 1, sizeof *r->names);
+  r->types = calloc(count + 1, sizeof *r->types);
+  if (!r->names || !r->types) {
+    perror("calloc()");
+    exit(EXIT_FAILURE);
+  }
+
+  for (r->signal_count = 0; r->signal_count < count; r->signal_count++) {
+    int type = getc(f);
+    uint64_t len;
+    if (type == EOF || type > TRACE_SIGNAL_TYPE_BOOL
+        || !htrc_read_varint(f, &len) || len > HTRC_MAX_NAME) {
+      fprintf(stderr, "[htrc] %s: bad signal declaration\n", file_name);
+      htrc_close(r);
+      return NULL;
+    }
+    char *name = malloc_checked(len + 1);
+    r->names[r->signal_count] = name;
+    r->types[r->signal_count] = type;
+    if (fread(name, 1, len, f) != len) {
+      fprintf(stderr, "[htrc] %s: truncated header\n", file_name);
+      r->signal_count++;
+      htrc_close(r);
+      return NULL;
+    }
+    name[len] = '\0';
+  }
+
+  return r;
+}
+
+void htrc_close(htrc_reader_t *r) {
+  assert (r);
+
+  for (size_t i = 0; i < r->signal_count; i++)
+    free(r->names[i]);
+  free(r->names);
+  free(r->types);
+  free(r->samples);
+  free(r->present);
+  free(r->raw);
+  free(r->stored);
+  fclose(r->f);
+  free(r);
+}
+
+trace_time_unit_t htrc_time_unit(const htrc_reader_t *r) {
+  return r->time_unit;
+}
+
+size_t htrc_time_unit_factor(const htrc_reader_t *r) {
+  return r->time_unit_factor;
+}
+
+size_t htrc_signal_count(const htrc_reader_t *r) {
+  return r->signal_count;
+}
+
+const char *htrc_signal_name(const htrc_reader_t *r, size_t signal) {
+  assert (signal < r->signal_count);
+  return r->names[signal];
+}
+
+trace_signal_type_t htrc_signal_type(const htrc_reader_t *r, size_t signal) {
+  assert (signal < r->signal_count);
+  return r->types[signal];
+}
+
+bool htrc_failed(const htrc_reader_t *r) {
+  return r->failed;
+}
+
+size_t htrc_block_first_cycle(const htrc_reader_t *r) {
+  return r->first_cycle;
+}
+
+size_t htrc_block_cycles(const htrc_reader_t *r) {
+  return r->cycles;
+}
+
+/** Decode the column of signal i, from p to end */
+bool htrc_decode_column(htrc_reader_t *r, size_t i,
+                        const unsigned char *p, const unsigned char *end) {
+  uint32_t *samples = r->samples + i * r->cycles;
+  bool *present = r->present + i * r->cycles;
+  uint64_t run;
+  size_t k = 0;
+
+  for (bool p_run = true; k < r->cycles; p_run = !p_run) {
+    if (!htrc_get_varint(&p, end, &run) || run > r->cycles - k)
+      return false;
+    memset(present + k, p_run, run);
+    k += run;
+  }
+
+  uint32_t prev = 0;
+  for (k = 0; k < r->cycles; k++) {
+    uint64_t v;
+    if (!present[k])
+      continue;
+    if (!htrc_get_varint(&p, end, &v))
+      return false;
+    if (r->types[i] == TRACE_SIGNAL_TYPE_FLOAT)
+      prev ^= (uint32_t)v;
+    else
+      prev += htrc_unzigzag((uint32_t)v);
+    samples[k] = prev;
+  }
+  return p == end;
+}
+
+/** Read and decode the next block, of which first_cycle was read already */
+bool htrc_read_block(htrc_reader_t *r, uint64_t first_cycle) {
+  uint64_t cycles, raw_size, stored_size;
+  int flags;
+
+  if (!htrc_read_varint(r->f, &cycles) || cycles > HTRC_BLOCK_CYCLES
+      || (flags = getc(r->f)) == EOF
+      || !htrc_read_varint(r->f, &raw_size)
+      || !htrc_read_varint(r->f, &stored_size)
+      || raw_size > (size_t)-1 / 2 || stored_size > (size_t)-1 / 2)
+    return false;
+
+  if (raw_size > r->raw_size) {
+    free(r->raw);
+    r->raw = malloc_checked(raw_size + 1);
+    r->raw_size = raw_size;
+  }
+  if (stored_size > r->stored_size) {
+    free(r->stored);
+    r->stored = malloc_checked(stored_size + 1);
+    r->stored_size = stored_size;
+  }
+  if (fread(r->stored, 1, stored_size, r->f) != stored_size)
+    return false;
+
+  if (flags & HTRC_BLOCK_ZLIB) {
+#ifdef HTRC_ZLIB
+    uLongf len = raw_size;
+    if (uncompress(r->raw, &len, r->stored, stored_size) != Z_OK
+        || len != raw_size)
+      return false;
+#else
+    fprintf(stderr, "[htrc] compressed block, rebuild with zlib\n");
+    return false;
+#endif
+  } else if (stored_size == raw_size) {
+    memcpy(r->raw, r->stored, raw_size);
+  } else {
+    return false;
+  }
+
+  /* Both bounds are checked, but keep the product from wrapping anyway. */
+  if (r->signal_count
+      && cycles > SIZE_MAX / sizeof *r->samples / r->signal_count)
+    return false;
+  if (cycles > r->capacity) {
+    free(r->samples);
+    free(r->present);
+    r->samples =
+      malloc_checked(r->signal_count * cycles * sizeof *r->samples + 1);
+    r->present =
+      malloc_checked(r->signal_count * cycles * sizeof *r->present + 1);
+    r->capacity = cycles;
+  }
+  r->first_cycle = first_cycle;
+  r->cycles = cycles;
+
+  const unsigned char *p = r->raw, *end = r->raw + raw_size;
+  for (size_t i = 0; i < r->signal_count; i++) {
+    uint64_t len;
+    if (!htrc_get_varint(&p, end, &len) || len > (size_t)(end - p)
+        || !htrc_decode_column(r, i, p, p + len))
+      return false;
+    p += len;
+  }
+  return p == end;
+}
+
+bool htrc_next_block(htrc_reader_t *r) {
+  assert (r);
+
+  uint64_t first_cycle;
+
+  if (r->failed || !htrc_read_varint(r->f, &first_cycle))
+    return false;
+  if (!htrc_read_block(r, first_cycle)) {
+    fprintf(stderr, "[htrc] corrupted or truncated block\n");
+    r->failed = true;
+    r->cycles = 0;
+    return false;
+  }
+  return true;
+}
+
+bool htrc_sample(const htrc_reader_t *r, size_t signal, size_t k,
+                 void *value) {
+  assert (signal < r->signal_count);
+  assert (k < r->cycles);
+
+  size_t i = signal * r->cycles + k;
+  if (!r->present[i])
+    return false;
+  memcpy(value, &r->samples[i], sizeof r->samples[i]);
+  return true;
+}
@@ -0,0 +1,65 @@
+#ifndef HTRC_H
+#define HTRC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trace_lib.h"
+
+/* The .htrc trace format stores each signal as a column, by blocks of up to
+   HTRC_BLOCK_CYCLES cycles. All integers below are LEB128 varints.
+
+   header  "HTRC" version:u8 time_unit:u8 time_unit_factor signal_count
+           { type:u8 name_length name }*
+   block   first_cycle cycles flags:u8 raw_size stored_size payload
+
+   The payload is zlib-compressed when flags has HTRC_BLOCK_ZLIB, and holds
+   one column per signal: its length in bytes, the lengths of its runs of
+   present and missing samples, alternating and starting with present ones,
+   then its present samples. Int and bool samples are zigzag deltas to the
+   previous sample of the column, float samples the XOR of their bits with
+   those of the previous sample. Columns restart from 0 in each block, so
+   that blocks decode independently. */
+
+#define HTRC_MAGIC "HTRC"
+#define HTRC_VERSION 1
+#define HTRC_BLOCK_CYCLES 4096
+#define HTRC_BLOCK_ZLIB 0x1
+#define HTRC_MAX_SIGNALS 65536        /* Larger counts are corrupt headers */
+#define HTRC_MAX_NAME 4096
+
+/** Encode v at p, which has room for 10 bytes; return the bytes used */
+size_t htrc_put_varint(unsigned char *p, uint64_t v);
+
+static inline uint32_t htrc_zigzag(uint32_t delta) {
+  return (delta << 1) ^ (uint32_t)-(int32_t)(delta >> 31);
+}
+
+static inline uint32_t htrc_unzigzag(uint32_t z) {
+  return (z >> 1) ^ (uint32_t)-(int32_t)(z & 1);
+}
+
+/* Readers go through a file block by block. Samples are 32-bit ints or
+   floats depending on the type of their signal. */
+
+typedef struct htrc_reader htrc_reader_t;
+
+htrc_reader_t *htrc_open(const char *file_name);
+void htrc_close(htrc_reader_t *);
+
+trace_time_unit_t htrc_time_unit(const htrc_reader_t *);
+size_t htrc_time_unit_factor(const htrc_reader_t *);
+size_t htrc_signal_count(const htrc_reader_t *);
+const char *htrc_signal_name(const htrc_reader_t *, size_t signal);
+trace_signal_type_t htrc_signal_type(const htrc_reader_t *, size_t signal);
+
+bool htrc_next_block(htrc_reader_t *);  /* false at the end or on errors */
+bool htrc_failed(const htrc_reader_t *);
+size_t htrc_block_first_cycle(const htrc_reader_t *);
+size_t htrc_block_cycles(const htrc_reader_t *);
+
+/** Whether signal has a sample at cycle k of the block, stored in value */
+bool htrc_sample(const htrc_reader_t *, size_t signal, size_t k, void *value);
+
+#endif  /* HTRC_H */
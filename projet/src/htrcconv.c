@@ -0,0 +1,75 @@
+/* This file is part of SyncContest.
+   Copyright (C) 2017-2020 Eugene Asarin, Mihaela Sighireanu, Adrien Guatto. */
+
+/* Converter of .htrc traces to the other trace formats, selected by the
+   extension of the output file. Blocks go through a trace stream, so memory
+   stays bounded however long the trace. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cutils.h"
+#include "htrc.h"
+#include "trace_lib.h"
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <in.htrc> <out.vcd|out.csv|out.htrc>\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  log_init(NULL);
+
+  htrc_reader_t *r = htrc_open(argv[1]);
+  if (!r)
+    log_fatal("[htrcconv] could not read %s\n", argv[1]);
+
+  size_t signal_count = htrc_signal_count(r);
+  trace_file_t *trace =
+    trace_file_alloc(htrc_time_unit(r), htrc_time_unit_factor(r));
+  trace_signal_t **signals = calloc(signal_count + 1, sizeof *signals);
+  if (!signals)
+    log_fatal("[htrcconv] out of memory\n");
+
+  for (size_t i = 0; i < signal_count; i++) {
+    signals[i] = trace_signal_alloc(htrc_signal_name(r, i),
+                                    htrc_signal_type(r, i), 4);
+    if (!trace_file_add_signal(trace, signals[i]))
+      log_fatal("[htrcconv] duplicate signal %s\n", htrc_signal_name(r, i));
+  }
+
+  trace_stream_t *stream = NULL;
+  size_t cycles = 0;
+  while (htrc_next_block(r)) {
+    if (!stream
+        && !(stream = trace_stream_open(trace, argv[2], HTRC_BLOCK_CYCLES,
+                                        htrc_block_first_cycle(r))))
+      log_fatal("[htrcconv] could not write %s\n", argv[2]);
+
+    for (size_t k = 0; k < htrc_block_cycles(r); k++) {
+      for (size_t i = 0; i < signal_count; i++) {
+        int v;
+        if (htrc_sample(r, i, k, &v))
+          trace_add_samples(signals[i], &v, 1);
+      }
+      trace_stream_cycle(stream);
+    }
+    cycles += htrc_block_cycles(r);
+  }
+
+  /* Empty traces still get their header. */
+  if (!stream
+      && !(stream = trace_stream_open(trace, argv[2], HTRC_BLOCK_CYCLES, 0)))
+    log_fatal("[htrcconv] could not write %s\n", argv[2]);
+
+  bool ok = trace_stream_close(stream) && !htrc_failed(r);
+  log_info("[htrcconv] %s: %zu signals, %zu cycles\n",
+           argv[2], signal_count, cycles);
+
+  htrc_close(r);
+  trace_file_free(trace);
+  free(signals);
+  log_shutdown();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
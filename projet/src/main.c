@@ -10,9 +10,14 @@
 #include "cutils.h"
 #include "map.h"
 #include "simulation_loop.h"
+#include "runner.h"
+#include "sweep.h"
+#include "replay.h"
 
 void usage() {
   fprintf(stderr, "Usage: scontest [OPTIONS] file.map\n");
+  fprintf(stderr, "       scontest -j <threads> [OPTIONS] file.map...\n");
+  fprintf(stderr, "       scontest -p <axis>=<values>... [OPTIONS] file.map\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -v              Be verbose\n");
   fprintf(stderr, "  -g              Show graphics\n");
@@ -20,24 +25,49 @@ void usage() {
   fprintf(stderr, "  -s <fps>        Simulation step/s (default: 60)\n");
   fprintf(stderr, "  -o <file>       Save log messages to <file>\n");
   fprintf(stderr, "  -w              Run in headless mode\n");
+  fprintf(stderr, "  -u              Run headless, as fast as possible, racing\n");
+  fprintf(stderr, "                  immediately\n");
   fprintf(stderr, "  -m <ticks>      Run at most <ticks> synchronous steps\n");
+  fprintf(stderr, "  -k <steps>      Catch up at most <steps> steps per frame\n");
+  fprintf(stderr, "                  (default: %d, 0 for no limit)\n",
+          SIMULATION_MAX_CATCH_UP);
   fprintf(stderr, "  -h              Display this message\n");
   fprintf(stderr, "  -a              Enable audio\n");
+  fprintf(stderr, "  -r <cm>         Bake map lookups in a raster of <cm> cells\n");
+  fprintf(stderr, "  -c <file>       Compile the map into <file> and exit\n");
+  fprintf(stderr, "  -R <file>       Record the inputs of the race into <file>\n");
+  fprintf(stderr, "  -P <file>       Replay the race recorded in <file>, unthrottled,\n");
+  fprintf(stderr, "                  and check that its outputs are unchanged\n");
+  fprintf(stderr, "  -S <ticks>      Check that the race resumes identically from\n");
+  fprintf(stderr, "                  snapshots taken after <ticks> steps\n");
+  fprintf(stderr, "  -j <threads>    Race on every map at once, unthrottled\n");
+  fprintf(stderr, "                  (the first unreadable map aborts them all)\n");
+  fprintf(stderr, "  -p <axis>=<values>\n");
+  fprintf(stderr, "                  Sweep the initial phase offset along <axis>\n");
+  fprintf(stderr, "                  (x, y or head) with <values> being <v>,\n");
+  fprintf(stderr, "                  lin(<a>,<b>,<n>), unif(<a>,<b>,<n>) or\n");
+  fprintf(stderr, "                  norm(<mean>,<stddev>,<n>)\n");
 }
 
 int main(int argc, char **argv) {
-  bool show_guide = true, headless = false, audio = false;
+  bool verbose = false, show_guide = true, headless = false, audio = false;
+  bool unthrottled = false, sweeping = false;
   int initial_top = false, opt;
-  char *log_filename = NULL;
-  size_t max_synchronous_steps = 0;
-  float sps = 60.f;
+  char *log_filename = NULL, *compiled_filename = NULL;
+  char *record_filename = NULL, *replay_filename = NULL;
+  size_t max_synchronous_steps = 0, threads = 0, snapshot_tick = 0;
+  bool check_snapshot = false;
+  size_t max_catch_up = SIMULATION_MAX_CATCH_UP;
+  float sps = 60.f, raster_res = 0.f;
+  sweep_t sweep;
 
-  hept_trace_init();
+  sweep_init(&sweep);
 
   /* Parse command line. */
-  while ((opt = getopt(argc, argv, "vgtf:o:wm:ha")) != -1) {
+  while ((opt = getopt(argc, argv, "vgtf:o:wum:k:har:c:j:p:R:P:S:")) != -1) {
     switch (opt) {
     case 'v':
+      verbose = true;
       log_set_verbosity_level(LOG_DEBUG);
       break;
 
@@ -65,14 +95,59 @@ int main(int argc, char **argv) {
       headless = true;
       break;
 
+    case 'u':
+      /* Nobody can start the race without a window. */
+      headless = true;
+      unthrottled = true;
+      initial_top = true;
+      break;
+
     case 'm':
       max_synchronous_steps = atoi(optarg);
       break;
 
+    case 'k':
+      max_catch_up = atoi(optarg);
+      break;
+
     case 'a':
       audio = true;
       break;
 
+    case 'r':
+      raster_res = atof(optarg);
+      break;
+
+    case 'c':
+      compiled_filename = optarg;
+      break;
+
+    case 'R':
+      record_filename = optarg;
+      break;
+
+    case 'P':
+      replay_filename = optarg;
+      break;
+
+    case 'S':
+      snapshot_tick = atoi(optarg);
+      check_snapshot = true;
+      break;
+
+    case 'j':
+      threads = atoi(optarg);
+      break;
+
+    case 'p':
+      if (!sweep_add_axis(&sweep, optarg)) {
+        fprintf(stderr, "Invalid sweep axis: %s\n", optarg);
+        usage();
+        return EXIT_FAILURE;
+      }
+      sweeping = true;
+      break;
+
     default:
       usage();
       return EXIT_FAILURE;
@@ -84,12 +159,115 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
+  /* Batches of races are unthrottled and neither compile, record nor
+     replay. */
+  if ((sweeping || threads > 0)
+      && (compiled_filename || record_filename || replay_filename
+          || unthrottled || check_snapshot)) {
+    fprintf(stderr,
+            "Options -c, -R, -P, -S and -u cannot be used with -j or -p\n");
+    usage();
+    return EXIT_FAILURE;
+  }
+
   /* Initialize logging system. */
   log_init(log_filename);
 
+  /* Race on every variant of the initial phase in parallel, then report the
+     results and their statistics. */
+  if (sweeping) {
+    size_t job_count;
+    race_job_t *jobs = sweep_jobs(&sweep, argv[optind], &job_count);
+
+    if (threads == 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cpus > 0 ? cpus : 1;
+    }
+
+    runner_options_t options = {
+      threads,
+      max_synchronous_steps,
+      raster_res,
+      verbose ? LOG_DEBUG : LOG_FATAL,
+      log_filename
+    };
+    runner_run(jobs, job_count, &options);
+    sweep_report(jobs, job_count);
+
+    bool all_succeeded = true;
+    for (size_t i = 0; i < job_count; i++)
+      all_succeeded = all_succeeded && jobs[i].result == RACE_SUCCESS;
+
+    free(jobs);
+    sweep_free(&sweep);
+    log_shutdown();
+    return all_succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  /* Race on every map in parallel, then report the results. */
+  if (threads > 0) {
+    size_t job_count = argc - optind;
+    race_job_t *jobs = calloc(job_count, sizeof *jobs);
+    if (!jobs)
+      log_fatal("[runner] could not allocate races\n");
+    for (size_t i = 0; i < job_count; i++)
+      jobs[i].map_filename = argv[optind + i];
+
+    runner_options_t options = {
+      threads,
+      max_synchronous_steps,
+      raster_res,
+      verbose ? LOG_DEBUG : LOG_FATAL,
+      log_filename
+    };
+    runner_run(jobs, job_count, &options);
+
+    bool all_succeeded = true;
+    const char *results[] = { "success", "crash", "timeout" };
+    for (size_t i = 0; i < job_count; i++) {
+      log_info("[runner] %s: %s, score = %d/%d, time = %f, %zu steps\n",
+               jobs[i].map_filename, results[jobs[i].result],
+               jobs[i].scoreA, jobs[i].scoreB, jobs[i].time, jobs[i].ticks);
+      all_succeeded = all_succeeded && jobs[i].result == RACE_SUCCESS;
+    }
+
+    free(jobs);
+    log_shutdown();
+    return all_succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  hept_trace_init();
+
   /* Load the map. */
   const char *filename = argv[optind];
   map_load(filename);
+  if (compiled_filename) {
+    map_compile(compiled_filename);
+    map_destroy();
+    log_shutdown();
+    hept_trace_quit();
+    return EXIT_SUCCESS;
+  }
+  if (raster_res > 0.f)
+    map_raster_load(filename, raster_res);
+
+  /* Replay a recorded race, and check that it went the same. */
+  if (replay_filename) {
+    bool same = replay_run(replay_filename);
+    map_destroy();
+    log_shutdown();
+    hept_trace_quit();
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  /* Check that snapshots of the race resume it identically. */
+  if (check_snapshot) {
+    bool same = replay_check_snapshot(snapshot_tick, max_synchronous_steps);
+    map_destroy();
+    log_shutdown();
+    hept_trace_quit();
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
   /* Run the simulation loop. */
   race_result_t r =
@@ -97,8 +275,11 @@ int main(int argc, char **argv) {
                     initial_top,
                     sps,
                     headless,
+                    unthrottled,
                     audio,
-                    max_synchronous_steps);
+                    max_synchronous_steps,
+                    max_catch_up,
+                    record_filename);
 
   switch (r) {
   case RACE_SUCCESS:
@@ -112,6 +293,11 @@ int main(int argc, char **argv) {
     break;
   }
 
+  log_info("[map] lookup memo: %zu hits, %zu misses\n",
+           map->memo.hits, map->memo.misses);
+  log_info("[map] lookup coherence: %zu hits, %zu misses\n",
+           map->coherence.hits, map->coherence.misses);
+
   /* Free the map, shutdown logs, and return. */
   map_destroy();
   log_shutdown();
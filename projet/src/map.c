@@ -1,11 +1,20 @@
 #include "map.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "mymath.h"
 #include "cutils.h"
 
-map_t *map;
+_Thread_local map_t *map;
 
 /*
  * =========================================================================
@@ -85,6 +94,10 @@ bool fourAnglesInOrder(float from,float x,float y, float to)
   }
 }
 
+/** The distance from a point to a road, as computed by isOnRoad(), is
+ *  1-Lipschitz up to this tolerance (EPS bounds of segments, rounding) */
+#define DIST_SLACK (4 * EPS)
+
 /** Product of two vectors for directions */
 float dirProd(float dir1x, float dir1y, float dir2x, float dir2y)
 {
@@ -132,6 +145,106 @@ dirProjPoint( /* IN  */ float x, float y, position_t * p1, position_t * p2,
   return;
 }
 
+/** Project point (x,y) on the middle line of the line road rd and
+ *  return result on (px, py)
+ */
+void roadProjPoint(road_t *rd, float x, float y, float *px, float *py)
+{
+  float t = (x - rd->u.line.startp.x) * rd->geo.ux
+    + (y - rd->u.line.startp.y) * rd->geo.uy;
+
+  (*px) = rd->u.line.startp.x + t * rd->geo.ux;
+  (*py) = rd->u.line.startp.y + t * rd->geo.uy;
+}
+
+/** Direction (vx,vy) from the center of the arc road rd lies inside the arc,
+ *  the same as isInArc() on its angle but without trigonometry
+ */
+bool isInRoadArc(road_t *rd, float vx, float vy)
+{
+  float c_first = dirVProd(rd->geo.arc_first_x, rd->geo.arc_first_y, vx, vy);
+  float c_last = dirVProd(vx, vy, rd->geo.arc_last_x, rd->geo.arc_last_y);
+
+  if (rd->geo.arc_span >= 360.0)
+    return true;
+  if (rd->geo.arc_span <= 180.0)
+    return c_first >= 0 && c_last >= 0;
+  // complement of the arc going from last to first
+  return c_first >= 0 || c_last >= 0;
+}
+
+/** Position of a point relative to a road */
+typedef struct {
+  float px, py;                 /* projection on the middle line of a line */
+  float angle;                  /* angle (in degree) around an arc center */
+  float key;                    /* position along the road, see road_bucket_t */
+} road_coord_t;
+
+void roadCoord(road_t *rd, float x, float y, road_coord_t *c)
+{
+  if (rd->kind == RD_ARC) {
+    c->angle = lineAngle(rd->u.arc.center.x, rd->u.arc.center.y, x, y);
+    c->key = c->angle;
+  } else {
+    c->key = (x - rd->u.line.startp.x) * rd->geo.ux
+      + (y - rd->u.line.startp.y) * rd->geo.uy;
+    c->px = rd->u.line.startp.x + c->key * rd->geo.ux;
+    c->py = rd->u.line.startp.y + c->key * rd->geo.uy;
+  }
+}
+
+/** Precompute the geometry of road rd, see @code{road_t} */
+void roadGeometry(road_t *rd)
+{
+  if (rd->kind != RD_ARC) {
+    float len = dirNorm(rd->dir_x, rd->dir_y);
+    rd->geo.inv_len = len > 0 ? 1.0 / len : 0.0;
+    rd->geo.ux = rd->dir_x * rd->geo.inv_len;
+    rd->geo.uy = rd->dir_y * rd->geo.inv_len;
+    rd->geo.xmin = fmin(rd->u.line.startp.x, rd->u.line.endp.x);
+    rd->geo.xmax = fmax(rd->u.line.startp.x, rd->u.line.endp.x);
+    rd->geo.ymin = fmin(rd->u.line.startp.y, rd->u.line.endp.y);
+    rd->geo.ymax = fmax(rd->u.line.startp.y, rd->u.line.endp.y);
+    return;
+  }
+
+  double cx = rd->u.arc.center.x;
+  double cy = rd->u.arc.center.y;
+  float r = rd->u.arc.radius;
+  float from = rd->u.arc.start_angle, to = rd->u.arc.end_angle;
+
+  rd->geo.arc_startp.x = cx + r * cos(toradian(from));
+  rd->geo.arc_startp.y = cy + r * sin(toradian(from));
+  rd->geo.arc_endp.x = cx + r * cos(toradian(to));
+  rd->geo.arc_endp.y = cy + r * sin(toradian(to));
+
+  // counterclockwise order of the angles
+  if (from > to) {
+    float tmp = from;
+    from = to;
+    to = tmp;
+  }
+  rd->geo.arc_first_x = cos(toradian(from));
+  rd->geo.arc_first_y = sin(toradian(from));
+  rd->geo.arc_last_x = cos(toradian(to));
+  rd->geo.arc_last_y = sin(toradian(to));
+  rd->geo.arc_span = to - from;
+
+  // bounding box: extremities, and the axis directions inside the arc
+  rd->geo.xmin = fmin(rd->geo.arc_startp.x, rd->geo.arc_endp.x);
+  rd->geo.xmax = fmax(rd->geo.arc_startp.x, rd->geo.arc_endp.x);
+  rd->geo.ymin = fmin(rd->geo.arc_startp.y, rd->geo.arc_endp.y);
+  rd->geo.ymax = fmax(rd->geo.arc_startp.y, rd->geo.arc_endp.y);
+  if (isInRoadArc(rd, 1, 0))
+    rd->geo.xmax = cx + r;
+  if (isInRoadArc(rd, 0, 1))
+    rd->geo.ymax = cy + r;
+  if (isInRoadArc(rd, -1, 0))
+    rd->geo.xmin = cx - r;
+  if (isInRoadArc(rd, 0, -1))
+    rd->geo.ymin = cy - r;
+}
+
 /*
  * =========================================================================
  * Parsing
@@ -273,6 +386,8 @@ void rd_segment_line_loader(FILE *f,
     log_fatal("[map %s] unknown road type %s (line %zu)\n",
               filename, kword, line);
   }
+
+  roadGeometry(rd);
 }
 
 void wayp_segment_line_loader(FILE *f,
@@ -297,6 +412,11 @@ void wayp_segment_line_loader(FILE *f,
       (wp->position.y >= MAX_Y)) {
     log_fatal("[map %s] waypoint format error (line %zu)\n", filename, line);
   }
+
+  road_t *rd = &map->road_arr[wp->road];
+  if (rd->kind == RD_ARC)
+    wp->angle = lineAngle(rd->u.arc.center.x, rd->u.arc.center.y,
+                          wp->position.x, wp->position.y);
 }
 
 void tl_segment_line_loader(FILE *f,
@@ -352,6 +472,11 @@ void st_segment_line_loader(FILE *f,
       (st->position.y <= MIN_Y) ||
       (st->position.y >= MAX_Y))
     log_fatal("[map %s] stop format error (line %zu)\n", filename, line);
+
+  road_t *rd = &map->road_arr[st->road];
+  if (rd->kind == RD_ARC)
+    st->angle = lineAngle(rd->u.arc.center.x, rd->u.arc.center.y,
+                          st->position.x, st->position.y);
 }
 
 void obst_segment_line_loader(FILE *f,
@@ -426,11 +551,501 @@ void map_read_string_line(FILE *f, const char *filename,
   log_info("[map %s] read %s: %s\n", filename, expected_kw, buff);
 }
 
+/*
+ * =========================================================================
+ * Spatial index
+ * =========================================================================
+ */
+
+/** Bounding box of the area where a point may be on road rd */
+void road_bbox(road_t *rd,
+               float *xmin, float *ymin, float *xmax, float *ymax) {
+  *xmin = rd->geo.xmin - (RD_SIZE_HALF_WIDTH + EPS);
+  *ymin = rd->geo.ymin - (RD_SIZE_HALF_WIDTH + EPS);
+  *xmax = rd->geo.xmax + (RD_SIZE_HALF_WIDTH + EPS);
+  *ymax = rd->geo.ymax + (RD_SIZE_HALF_WIDTH + EPS);
+}
+
+/** Grid cell containing coordinate v, clamped to the grid */
+static inline int grid_cell(float v, float min, int cell_count) {
+  int c = floorf((v - min) / MAP_GRID_CELL);
+  return c < 0 ? 0 : (c >= cell_count ? cell_count - 1 : c);
+}
+
+/** Build the uniform grid mapping each cell to the roads nearby. Roads are
+    stored by increasing identifiers in each cell, so that scanning a cell
+    visits them in the same order as scanning road_arr. */
+void map_index_build() {
+  map->grid_w = ceil((MAX_X - MIN_X) / MAP_GRID_CELL);
+  map->grid_h = ceil((MAX_Y - MIN_Y) / MAP_GRID_CELL);
+
+  size_t cell_count = map->grid_w * map->grid_h;
+  map->grid_offs = calloc(cell_count + 1, sizeof *map->grid_offs);
+  assert(map->grid_offs);
+
+  /* First pass: count the roads in each cell, second pass: fill them. */
+  for (int pass = 0; pass < 2; pass++) {
+    int *fill = NULL;
+
+    if (pass == 1) {
+      for (size_t c = 0; c < cell_count; c++)
+        map->grid_offs[c + 1] += map->grid_offs[c];
+      map->grid_roads = calloc(map->grid_offs[cell_count] + 1,
+                               sizeof *map->grid_roads);
+      fill = calloc(cell_count, sizeof *fill);
+      assert(map->grid_roads);
+      assert(fill);
+    }
+
+    for (int rid = 0; rid < map->road_sz; rid++) {
+      float xmin, ymin, xmax, ymax;
+      road_bbox(&map->road_arr[rid], &xmin, &ymin, &xmax, &ymax);
+
+      int cx0 = grid_cell(xmin, MIN_X, map->grid_w);
+      int cx1 = grid_cell(xmax, MIN_X, map->grid_w);
+      int cy0 = grid_cell(ymin, MIN_Y, map->grid_h);
+      int cy1 = grid_cell(ymax, MIN_Y, map->grid_h);
+
+      for (int cy = cy0; cy <= cy1; cy++)
+        for (int cx = cx0; cx <= cx1; cx++) {
+          int c = cy * map->grid_w + cx;
+          if (pass == 0)
+            map->grid_offs[c + 1]++;
+          else
+            map->grid_roads[map->grid_offs[c] + fill[c]++] = rid;
+        }
+    }
+
+    free(fill);
+  }
+
+  /* Copy the geometry of the roads in SoA layout, see road_soa_t. */
+  int entries = map->grid_offs[cell_count];
+  road_soa_t *soa = &map->grid_soa;
+  float **fields[] = { &soa->ax, &soa->ay, &soa->ux, &soa->uy,
+                       &soa->len, &soa->r };
+  for (size_t f = 0; f < sizeof fields / sizeof *fields; f++) {
+    *fields[f] = calloc(entries + 1, sizeof **fields[f]);
+    assert (*fields[f]);
+  }
+  for (int i = 0; i < entries; i++) {
+    road_t *rd = &map->road_arr[map->grid_roads[i]];
+    switch (rd->kind) {
+    case RD_LINE_1:
+      soa->ax[i] = rd->u.line.startp.x;
+      soa->ay[i] = rd->u.line.startp.y;
+      soa->ux[i] = rd->geo.ux;
+      soa->uy[i] = rd->geo.uy;
+      soa->len[i] = rd->geo.inv_len > 0 ? 1.0 / rd->geo.inv_len : 0.0;
+      break;
+    case RD_ARC:
+      soa->ax[i] = rd->u.arc.center.x;
+      soa->ay[i] = rd->u.arc.center.y;
+      soa->r[i] = rd->u.arc.radius;
+      break;
+    default:
+      /* Never on road, make it infinitely far. */
+      soa->r[i] = -HUGE_VALF;
+      break;
+    }
+  }
+
+  log_info("[map] indexed %d roads in %dx%d cells (%d entries)\n",
+           map->road_sz, map->grid_w, map->grid_h,
+           map->grid_offs[cell_count]);
+}
+
+/** Lower bounds lb[0] to lb[n - 1] on the distances from (x, y) to the roads
+    of entries i0 to i0 + n - 1 of the SoA table, up to EPS. */
+void road_soa_lower_bounds(const road_soa_t *t, int i0, int n,
+                           float x, float y, float *lb) {
+  int i = 0;
+
+#if defined(__SSE2__)
+  __m128 x4 = _mm_set1_ps(x), y4 = _mm_set1_ps(y);
+  __m128 zero4 = _mm_setzero_ps(), sign4 = _mm_set1_ps(-0.f);
+  for (; i + 4 <= n; i += 4) {
+    __m128 dx = _mm_sub_ps(x4, _mm_loadu_ps(t->ax + i0 + i));
+    __m128 dy = _mm_sub_ps(y4, _mm_loadu_ps(t->ay + i0 + i));
+    __m128 ux = _mm_loadu_ps(t->ux + i0 + i);
+    __m128 uy = _mm_loadu_ps(t->uy + i0 + i);
+    __m128 s = _mm_add_ps(_mm_mul_ps(dx, ux), _mm_mul_ps(dy, uy));
+    s = _mm_min_ps(_mm_max_ps(s, zero4), _mm_loadu_ps(t->len + i0 + i));
+    dx = _mm_sub_ps(dx, _mm_mul_ps(s, ux));
+    dy = _mm_sub_ps(dy, _mm_mul_ps(s, uy));
+    __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+                                      _mm_mul_ps(dy, dy)));
+    d = _mm_sub_ps(d, _mm_loadu_ps(t->r + i0 + i));
+    _mm_storeu_ps(lb + i, _mm_andnot_ps(sign4, d));
+  }
+#endif
+
+  /* Scalar fallback, and remaining entries. */
+  for (; i < n; i++) {
+    int j = i0 + i;
+    float dx = x - t->ax[j], dy = y - t->ay[j];
+    float s = fminf(fmaxf(dx * t->ux[j] + dy * t->uy[j], 0.f), t->len[j]);
+    dx -= s * t->ux[j];
+    dy -= s * t->uy[j];
+    lb[i] = fabsf(sqrtf(dx * dx + dy * dy) - t->r[j]);
+  }
+}
+
+/** Group n elements by road, elements[i] being on road roads[i] at
+    position keys[i] along it. */
+void road_bucket_build(road_bucket_t *b, int n,
+                       const int *roads, const float *keys) {
+  b->offs = calloc(map->road_sz + 1, sizeof *b->offs);
+  b->idx = calloc(n + 1, sizeof *b->idx);
+  b->key = calloc(n + 1, sizeof *b->key);
+  assert (b->offs);
+  assert (b->idx);
+  assert (b->key);
+
+  for (int i = 0; i < n; i++)
+    b->offs[roads[i] + 1]++;
+  for (int r = 0; r < map->road_sz; r++)
+    b->offs[r + 1] += b->offs[r];
+
+  /* Insertion sort by key inside each road, buckets are small. */
+  int *fill = calloc(map->road_sz, sizeof *fill);
+  assert (fill);
+  for (int i = 0; i < n; i++) {
+    int j = b->offs[roads[i]] + fill[roads[i]]++;
+    for (; j > b->offs[roads[i]] && b->key[j - 1] > keys[i]; j--) {
+      b->idx[j] = b->idx[j - 1];
+      b->key[j] = b->key[j - 1];
+    }
+    b->idx[j] = i;
+    b->key[j] = keys[i];
+  }
+  free(fill);
+}
+
+void road_bucket_free(road_bucket_t *b) {
+  free(b->offs);
+  free(b->idx);
+  free(b->key);
+}
+
+/** Range [*lo, *hi[ of the elements of road rid with keys within w of key */
+void road_bucket_range(const road_bucket_t *b, int rid, float key, float w,
+                       int *lo, int *hi) {
+  int l = b->offs[rid], h = b->offs[rid + 1];
+
+  /* Lower bound of key - w. */
+  while (l < h) {
+    int m = l + (h - l) / 2;
+    if (b->key[m] < key - w)
+      l = m + 1;
+    else
+      h = m;
+  }
+  *lo = l;
+  for (h = l; h < b->offs[rid + 1] && b->key[h] <= key + w; h++);
+  *hi = h;
+}
+
+/** Position along road rid of point p, see road_bucket_t */
+float road_key(int rid, position_t *p) {
+  road_coord_t c;
+  roadCoord(&map->road_arr[rid], p->x, p->y, &c);
+  return c.key;
+}
+
+void map_buckets_build() {
+  int n = map->wayp_sz + map->tlight_sz + map->stop_sz;
+  int *roads = calloc(n + 1, sizeof *roads);
+  float *keys = calloc(n + 1, sizeof *keys);
+  assert (roads);
+  assert (keys);
+
+  for (int i = 0; i < map->wayp_sz; i++) {
+    roads[i] = map->wayp_arr[i].road;
+    keys[i] = road_key(roads[i], &map->wayp_arr[i].position);
+  }
+  road_bucket_build(&map->wayp_by_road, map->wayp_sz, roads, keys);
+
+  for (int i = 0; i < map->tlight_sz; i++) {
+    roads[i] = map->tlight_arr[i].road;
+    keys[i] = road_key(roads[i], &map->tlight_arr[i].tl.ptl_pos);
+  }
+  road_bucket_build(&map->tlight_by_road, map->tlight_sz, roads, keys);
+
+  for (int i = 0; i < map->stop_sz; i++) {
+    roads[i] = map->stop_arr[i].road;
+    keys[i] = road_key(roads[i], &map->stop_arr[i].position);
+  }
+  road_bucket_build(&map->stop_by_road, map->stop_sz, roads, keys);
+
+  free(roads);
+  free(keys);
+}
+
+/*
+ * =========================================================================
+ * Compiled maps
+ * =========================================================================
+ */
+
+/* A compiled map is a header followed by every array of map_t, including the
+   precomputed road geometry and the spatial index, in one file. Loading it
+   maps the file read-only and points the arrays into it, so that startup does
+   not depend on the size of the map and processes share the same pages. */
+
+#define MAP_IMAGE_MAGIC    "SCMAPIMG"
+#define MAP_IMAGE_VERSION  1
+#define MAP_IMAGE_ALIGN    64
+#define MAP_IMAGE_SECTIONS 23
+
+/** Open a new temporary file next to filename, whose name is stored in tmp.
+    Every thread and process gets its own file. */
+FILE *tmp_file_open(const char *filename, char *tmp, size_t tmp_size) {
+  snprintf(tmp, tmp_size, "%s.XXXXXX", filename);
+  int fd = mkstemp(tmp);
+  if (fd < 0)
+    return NULL;
+  fchmod(fd, 0644);
+  FILE *f = fdopen(fd, "wb");
+  if (!f)
+    close(fd);
+  return f;
+}
+
+typedef struct {
+  char     magic[8];            /* MAP_IMAGE_MAGIC */
+  uint32_t version;             /* MAP_IMAGE_VERSION */
+  uint32_t reserved;
+  char     name[255];           /* see map_t */
+  char     graphics[255];
+  char     guide[255];
+  phase_t  init_phase;
+  int32_t  road_sz, wayp_sz, tlight_sz, stop_sz, obst_sz, iti_sz;
+  int32_t  grid_w, grid_h;
+  uint64_t offs[MAP_IMAGE_SECTIONS];  /* offset of each section in the file */
+  uint64_t count[MAP_IMAGE_SECTIONS]; /* element count of each section */
+  uint32_t elt[MAP_IMAGE_SECTIONS];   /* element size of each section */
+  uint64_t size;                      /* size of the file */
+} map_image_header_t;
+
+typedef struct {
+  void   **ptr;                 /* array of map_t */
+  size_t elt;                   /* element size */
+} map_section_t;
+
+/** Arrays of the map, in the order of the sections of a compiled map */
+void map_sections(map_section_t s[MAP_IMAGE_SECTIONS]) {
+#define SECTION(i, field) \
+  s[i] = (map_section_t){ (void **)&map->field, sizeof *map->field }
+  SECTION(0, road_arr);
+  SECTION(1, wayp_arr);
+  SECTION(2, tlight_arr);
+  SECTION(3, stop_arr);
+  SECTION(4, obst_arr);
+  SECTION(5, iti_arr);
+  SECTION(6, grid_offs);
+  SECTION(7, grid_roads);
+  SECTION(8, grid_soa.ax);
+  SECTION(9, grid_soa.ay);
+  SECTION(10, grid_soa.ux);
+  SECTION(11, grid_soa.uy);
+  SECTION(12, grid_soa.len);
+  SECTION(13, grid_soa.r);
+  SECTION(14, wayp_by_road.offs);
+  SECTION(15, wayp_by_road.idx);
+  SECTION(16, wayp_by_road.key);
+  SECTION(17, tlight_by_road.offs);
+  SECTION(18, tlight_by_road.idx);
+  SECTION(19, tlight_by_road.key);
+  SECTION(20, stop_by_road.offs);
+  SECTION(21, stop_by_road.idx);
+  SECTION(22, stop_by_road.key);
+#undef SECTION
+}
+
+/** Element counts of the sections of the loaded map */
+void map_section_counts(uint64_t count[MAP_IMAGE_SECTIONS]) {
+  uint64_t cells = (uint64_t)map->grid_w * map->grid_h;
+  uint64_t entries = map->grid_offs[cells];
+
+  count[0] = map->road_sz;
+  count[1] = map->wayp_sz;
+  count[2] = map->tlight_sz;
+  count[3] = map->stop_sz;
+  count[4] = map->obst_sz;
+  count[5] = map->iti_sz;
+  count[6] = cells + 1;
+  count[7] = entries;
+  for (int i = 8; i < 14; i++)
+    count[i] = entries;
+  count[14] = map->road_sz + 1;
+  count[15] = count[16] = map->wayp_sz;
+  count[17] = map->road_sz + 1;
+  count[18] = count[19] = map->tlight_sz;
+  count[20] = map->road_sz + 1;
+  count[21] = count[22] = map->stop_sz;
+}
+
+void map_compile(const char *filename) {
+  assert (map);
+  assert (filename);
+
+  map_image_header_t header;
+  bzero(&header, sizeof header);
+  memcpy(header.magic, MAP_IMAGE_MAGIC, sizeof header.magic);
+  header.version = MAP_IMAGE_VERSION;
+  memcpy(header.name, map->name, sizeof header.name);
+  memcpy(header.graphics, map->graphics, sizeof header.graphics);
+  memcpy(header.guide, map->guide, sizeof header.guide);
+  header.init_phase = map->init_phase;
+  header.road_sz = map->road_sz;
+  header.wayp_sz = map->wayp_sz;
+  header.tlight_sz = map->tlight_sz;
+  header.stop_sz = map->stop_sz;
+  header.obst_sz = map->obst_sz;
+  header.iti_sz = map->iti_sz;
+  header.grid_w = map->grid_w;
+  header.grid_h = map->grid_h;
+
+  map_section_t sections[MAP_IMAGE_SECTIONS];
+  map_sections(sections);
+  map_section_counts(header.count);
+
+  /* Align the sections, which also keeps the SoA arrays SIMD friendly. */
+  uint64_t offs = sizeof header;
+  for (int i = 0; i < MAP_IMAGE_SECTIONS; i++) {
+    offs = (offs + MAP_IMAGE_ALIGN - 1) / MAP_IMAGE_ALIGN * MAP_IMAGE_ALIGN;
+    header.offs[i] = offs;
+    header.elt[i] = sections[i].elt;
+    offs += header.count[i] * sections[i].elt;
+  }
+  header.size = offs;
+
+  /* Write to a temporary file first, concurrent runs might read it. */
+  char tmp_filename[512 + 16];
+  FILE *f = tmp_file_open(filename, tmp_filename, sizeof tmp_filename);
+  bool saved = f && fwrite(&header, sizeof header, 1, f) == 1;
+  for (int i = 0; i < MAP_IMAGE_SECTIONS && saved; i++) {
+    size_t n = header.count[i];
+    saved = fseek(f, header.offs[i], SEEK_SET) == 0
+      && fwrite(*sections[i].ptr, sections[i].elt, n, f) == n;
+  }
+  saved = saved && fseek(f, header.size, SEEK_SET) == 0;
+  if (f)
+    saved = (fclose(f) == 0) && saved;
+  saved = saved && truncate(tmp_filename, header.size) == 0
+    && rename(tmp_filename, filename) == 0;
+
+  if (!saved) {
+    if (f)
+      remove(tmp_filename);
+    log_fatal("[map] could not write compiled map %s\n", filename);
+  }
+  log_info("[map] compiled %s (%zu bytes)\n", filename, (size_t)header.size);
+}
+
+/** Map the compiled map in filename, false if it is not a compiled map. */
+bool map_load_image(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    log_fatal("[map %s] could not open file\n", filename);
+
+  map_image_header_t header;
+  struct stat st;
+  bool is_image = read(fd, &header, sizeof header) == sizeof header
+    && memcmp(header.magic, MAP_IMAGE_MAGIC, sizeof header.magic) == 0;
+  if (!is_image) {
+    close(fd);
+    return false;
+  }
+
+  if (header.version != MAP_IMAGE_VERSION)
+    log_fatal("[map %s] compiled map version %u, expected %u\n",
+              filename, header.version, MAP_IMAGE_VERSION);
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != header.size)
+    log_fatal("[map %s] truncated compiled map\n", filename);
+
+  void *image = mmap(NULL, header.size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    log_fatal("[map %s] could not map compiled map\n", filename);
+
+  map->image = image;
+  map->image_sz = header.size;
+  memcpy(map->name, header.name, sizeof map->name);
+  memcpy(map->graphics, header.graphics, sizeof map->graphics);
+  memcpy(map->guide, header.guide, sizeof map->guide);
+  map->name[sizeof map->name - 1] = 0;
+  map->graphics[sizeof map->graphics - 1] = 0;
+  map->guide[sizeof map->guide - 1] = 0;
+  map->init_phase = header.init_phase;
+  map->road_sz = header.road_sz;
+  map->wayp_sz = header.wayp_sz;
+  map->tlight_sz = header.tlight_sz;
+  map->stop_sz = header.stop_sz;
+  map->obst_sz = header.obst_sz;
+  map->iti_sz = header.iti_sz;
+  map->grid_w = header.grid_w;
+  map->grid_h = header.grid_h;
+
+  /* Point the arrays into the image, the layout must match this build. */
+  map_section_t sections[MAP_IMAGE_SECTIONS];
+  map_sections(sections);
+  for (int i = 0; i < MAP_IMAGE_SECTIONS; i++) {
+    /* Checked without overflows, the header might be corrupt. */
+    if (header.elt[i] != sections[i].elt
+        || header.offs[i] % MAP_IMAGE_ALIGN != 0
+        || header.offs[i] > header.size
+        || header.count[i] > (header.size - header.offs[i]) / header.elt[i])
+      log_fatal("[map %s] compiled map does not match this build (section %d),"
+                " please recompile it\n", filename, i);
+    *sections[i].ptr = (char *)image + header.offs[i];
+  }
+
+  /* The counts of the other sections derive from the grid offsets, which
+     must then have one entry per cell and one for the end. */
+  uint64_t count[MAP_IMAGE_SECTIONS];
+  if (map->grid_w < 0 || map->grid_h < 0
+      || header.count[6] != (uint64_t)map->grid_w * map->grid_h + 1)
+    log_fatal("[map %s] inconsistent compiled map\n", filename);
+  map_section_counts(count);
+  if (memcmp(count, header.count, sizeof count) != 0)
+    log_fatal("[map %s] inconsistent compiled map\n", filename);
+
+  log_info("[map %s] mapped compiled map: %d roads, %d waypoints,"
+           " %d traffic lights, %d stops (%zu bytes)\n",
+           filename, map->road_sz, map->wayp_sz, map->tlight_sz, map->stop_sz,
+           map->image_sz);
+  return true;
+}
+
+/** FNV-1a hash of the contents of a file, 0 if it cannot be read */
+uint64_t file_hash(const char *filename) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  unsigned char buff[4096];
+  size_t n;
+  FILE *f = fopen(filename, "rb");
+
+  if (!f)
+    return 0;
+  while ((n = fread(buff, 1, sizeof buff, f)) > 0)
+    for (size_t i = 0; i < n; i++)
+      h = (h ^ buff[i]) * 0x100000001b3ULL;
+  fclose(f);
+  return h;
+}
+
 void map_load(const char *filename) {
   map = malloc(sizeof *map);
   assert(map);
   bzero(map, sizeof *map);
 
+  map->tlight_view.sz = -1;
+  map->obst_view.sz = -1;
+  map->hash = file_hash(filename);
+  if (map_load_image(filename))
+    return;
+
   size_t line = 1;
   FILE *f = fopen(filename, "r");
   if (!f)
@@ -457,57 +1072,171 @@ void map_load(const char *filename) {
   /* Read the roads. */
   map_load_segment(f, filename, rd_segment_line_loader, "rd",
                    &map->road_arr, &map->road_sz, sizeof *map->road_arr,
-                   MAX_ROAD_COUNT, &line);
+                   INT_MAX, &line);
 
   /* Read the waypoints. */
   map_load_segment(f, filename, wayp_segment_line_loader, "wp",
                    &map->wayp_arr, &map->wayp_sz, sizeof *map->wayp_arr,
-                   MAX_WAYP_COUNT, &line);
+                   INT_MAX, &line);
 
   /* Read the traffic lights. */
   map_load_segment(f, filename, tl_segment_line_loader, "tl",
                    &map->tlight_arr, &map->tlight_sz, sizeof *map->tlight_arr,
-                   MAX_TL_COUNT, &line);
+                   INT_MAX, &line);
 
   /* Read the stops. */
   map_load_segment(f, filename, st_segment_line_loader, "st",
                    &map->stop_arr, &map->stop_sz, sizeof *map->stop_arr,
-                   MAX_STOP_COUNT, &line);
+                   INT_MAX, &line);
 
   /* Read the obstacles. */
   map_load_segment(f, filename, obst_segment_line_loader, "obst",
                    &map->obst_arr, &map->obst_sz, sizeof *map->obst_arr,
-                   MAX_OBST_COUNT, &line);
+                   INT_MAX, &line);
 
   /* Read the obstacles. */
   map_load_segment(f, filename, iti_segment_line_loader, "iti",
                    &map->iti_arr, &map->iti_sz, sizeof *map->iti_arr,
                    MAX_ITI_COUNT, &line);
 
-  /* Close file and return. */
+  /* Close file, index the roads and their elements, and return. */
   fclose(f);
+  map_index_build();
+  map_buckets_build();
 }
 
 void map_destroy() {
   if (!map)
     return;
 
+  /* Arrays of a compiled map point into its image. */
+  if (map->image) {
+    munmap(map->image, map->image_sz);
+    map->image = NULL;
+    map_section_t sections[MAP_IMAGE_SECTIONS];
+    map_sections(sections);
+    for (int i = 0; i < MAP_IMAGE_SECTIONS; i++)
+      *sections[i].ptr = NULL;
+  }
+
   /* Fields have been initialized to NULL, it is safe to call free() on them. */
   free(map->road_arr);
   free(map->wayp_arr);
   free(map->tlight_arr);
   free(map->stop_arr);
   free(map->obst_arr);
+  free(map->iti_arr);
+  free(map->grid_offs);
+  free(map->grid_roads);
+  free(map->grid_soa.ax);
+  free(map->grid_soa.ay);
+  free(map->grid_soa.ux);
+  free(map->grid_soa.uy);
+  free(map->grid_soa.len);
+  free(map->grid_soa.r);
+  road_bucket_free(&map->wayp_by_road);
+  road_bucket_free(&map->tlight_by_road);
+  road_bucket_free(&map->stop_by_road);
+  if (map->raster_image)
+    munmap(map->raster_image, map->raster_image_sz);
+  else
+    free((int16_t *)map->raster);
   free(map);
   map = NULL;
 }
 
-void Map__read_obstacles_step(Map__read_obstacles_out *o) {
-  /* TODO very inefficient */
-  memcpy(o->obst, map->obst_arr, map->obst_sz * sizeof *o->obst);
+/*
+ * =========================================================================
+ * Windowed views
+ * =========================================================================
+ */
+
+/** Add element id of rank r to the view v of at most cap elements, keeping
+    the elements of lowest ranks sorted by rank in ranks. Ties keep the
+    element added first. */
+void view_insert(map_view_t *v, float *ranks, int cap, int id, float r) {
+  int j = v->sz < cap ? v->sz++ : cap;
+  if (j == cap && r >= ranks[cap - 1])
+    return;
+  if (j == cap)
+    j--;
+  for (; j > 0 && ranks[j - 1] > r; j--) {
+    ranks[j] = ranks[j - 1];
+    v->ids[j] = v->ids[j - 1];
+  }
+  ranks[j] = r;
+  v->ids[j] = id;
+}
 
-  /* The map file might contain fewer obstacles than Globals__obstnum. */
-  for (size_t i = map->obst_sz; i < MAX_OBST_COUNT; i++) {
+/** Sort the identifiers of view v. */
+void view_sort(map_view_t *v) {
+  for (int i = 1; i < v->sz; i++)
+    for (int j = i; j > 0 && v->ids[j - 1] > v->ids[j]; j--) {
+      int id = v->ids[j];
+      v->ids[j] = v->ids[j - 1];
+      v->ids[j - 1] = id;
+    }
+}
+
+/** Traffic lights in view from pos, the nearest ones to it */
+map_view_t *tlight_view(position_t pos) {
+  map_view_t *v = &map->tlight_view;
+  if (v->sz >= 0 && v->pos.x == pos.x && v->pos.y == pos.y)
+    return v;
+
+  float ranks[MAX_VIEW_COUNT];
+  v->pos = pos;
+  v->sz = 0;
+  for (int i = 0; i < map->tlight_sz; i++) {
+    position_t *p = &map->tlight_arr[i].tl.ptl_pos;
+    float dx = p->x - pos.x, dy = p->y - pos.y;
+    view_insert(v, ranks, MAX_TL_COUNT, i, dx * dx + dy * dy);
+  }
+  view_sort(v);
+  return v;
+}
+
+/** Obstacles in view from pos at time, the nearest present ones first */
+map_view_t *obst_view(position_t pos, float time) {
+  map_view_t *v = &map->obst_view;
+  if (v->sz >= 0 && v->pos.x == pos.x && v->pos.y == pos.y && v->time == time)
+    return v;
+
+  float ranks[MAX_VIEW_COUNT];
+  v->pos = pos;
+  v->time = time;
+  v->sz = 0;
+  for (int i = 0; i < map->obst_sz; i++) {
+    obst_t *o = &map->obst_arr[i];
+    float dx = o->pot_pos.x - pos.x, dy = o->pot_pos.y - pos.y;
+    bool present = o->pot_since <= time && time <= o->pot_till;
+    view_insert(v, ranks, MAX_OBST_COUNT, i,
+                present ? dx * dx + dy * dy : HUGE_VALF);
+  }
+  view_sort(v);
+  return v;
+}
+
+/** Index of traffic light tl in the view from pos, -1 if not in view */
+int tlight_view_index(position_t pos, int tl) {
+  if (tl < 0 || map->tlight_sz <= MAX_TL_COUNT)
+    return tl;
+
+  map_view_t *v = tlight_view(pos);
+  for (int i = 0; i < v->sz; i++)
+    if (v->ids[i] == tl)
+      return i;
+  return -1;
+}
+
+void Map__read_obstacles_step(Globals__position pos, float time,
+                              Map__read_obstacles_out *o) {
+  map_view_t *v = obst_view(pos, time);
+  for (int i = 0; i < v->sz; i++)
+    o->obst[i] = map->obst_arr[v->ids[i]];
+
+  /* The map might contain fewer obstacles than Globals__obstnum. */
+  for (size_t i = v->sz; i < MAX_OBST_COUNT; i++) {
     o->obst[i].pot_pos.x = 0.f;
     o->obst[i].pot_pos.y = 0.f;
     o->obst[i].pot_since = -1.f;
@@ -526,11 +1255,12 @@ void Map__read_itinerary_step(Map__read_itinerary_out *o) {
   }
 }
 
-void Map__read_traffic_lights_step(Map__read_traffic_lights_out *o) {
-  assert (map->tlight_sz <= Globals__trafnum);
-  for (size_t i = 0; i < map->tlight_sz; i++)
-    memcpy(&o->tlights[i], &map->tlight_arr[i].tl, sizeof *map->tlight_arr);
-  for (size_t i = map->tlight_sz; i < MAX_TL_COUNT; i++)
+void Map__read_traffic_lights_step(Globals__position pos,
+                                   Map__read_traffic_lights_out *o) {
+  map_view_t *v = tlight_view(pos);
+  for (int i = 0; i < v->sz; i++)
+    o->tlights[i] = map->tlight_arr[v->ids[i]].tl;
+  for (size_t i = v->sz; i < MAX_TL_COUNT; i++)
     o->tlights[i] = (Globals__param_tlight){ {-100, -100}, 0, 0, 0, 0 };
 }
 
@@ -544,12 +1274,12 @@ bool isOnRoadLine1(road_t *rd, float x, float y,
   // -compute projection on line
   float                   px = 0.0;
   float                   py = 0.0;
-  dirProjPoint(x, y, &(rd->u.line.startp), &(rd->u.line.endp), &px, &py);
+  roadProjPoint(rd, x, y, &px, &py);
   //-compare with ends of the segment
-  if ((px <= fmax(rd->u.line.startp.x, rd->u.line.endp.x)+EPS) &&
-      (px >= fmin(rd->u.line.startp.x, rd->u.line.endp.x)-EPS) &&
-      (py <= fmax(rd->u.line.startp.y, rd->u.line.endp.y)+EPS) &&
-      (py >= fmin(rd->u.line.startp.y, rd->u.line.endp.y)-EPS))
+  if ((px <= rd->geo.xmax+EPS) &&
+      (px >= rd->geo.xmin-EPS) &&
+      (py <= rd->geo.ymax+EPS) &&
+      (py >= rd->geo.ymin-EPS))
     //the projection is inside, compute distance to rd
     (*d) = distance(x, y, px, py);
   else
@@ -616,25 +1346,18 @@ bool isOnRoadArc(/* IN  */
   double          cx = rd->u.arc.center.x;
   double          cy = rd->u.arc.center.y;
 
-  //compute angle(in degrees) from center
-  double          a = lineAngle(cx, cy, x, y);
-
   //compute signed distance to the circle c
   double     dist_c = distance(cx, cy, x, y) - rd->u.arc.radius;
 
-  if (isInArc(a, rd->u.arc.start_angle,rd->u.arc.end_angle)) {
+  if (isInRoadArc(rd, x - cx, y - cy)) {
     //within the angle
     (*d) = fabs(dist_c);
   }
   else {
     //Point outside road angles,
     //  consider the distance to extremities
-    (*d) = fmin(distance(x,y,
-                         cx+rd->u.arc.radius*cos(toradian(rd->u.arc.start_angle)),
-                         cy+rd->u.arc.radius*sin(toradian(rd->u.arc.start_angle))),
-                distance(x,y,
-                         cx+rd->u.arc.radius*cos(toradian(rd->u.arc.end_angle)),
-                         cy+rd->u.arc.radius*sin(toradian(rd->u.arc.end_angle))));
+    (*d) = fmin(distance(x, y, rd->geo.arc_startp.x, rd->geo.arc_startp.y),
+                distance(x, y, rd->geo.arc_endp.x, rd->geo.arc_endp.y));
   }
 
   if ((*d) >= RD_SIZE_HALF_WIDTH) {
@@ -683,6 +1406,21 @@ bool isOnRoadArc(/* IN  */
   return true;
 }
 
+bool isOnRoad(road_t *rd, float x, float y,
+              Globals__color *col, double *d, float *dir_x, float *dir_y) {
+  switch (rd->kind) {
+  case RD_LINE_1:
+    return isOnRoadLine1(rd, x, y, col, d, dir_x, dir_y);
+  case RD_LINE_2:
+    return isOnRoadLine2(rd, x, y, col, d, dir_x, dir_y);
+  case RD_ARC:
+    return isOnRoadArc(rd, x, y, col, d, dir_x, dir_y);
+  case RD_OTHER:
+    break;
+  }
+  return false;
+}
+
 int isOnTLight(int x, int y, int rd, float dir_x, float dir_y)
 {
   if (map->tlight_arr == NULL ||
@@ -690,10 +1428,21 @@ int isOnTLight(int x, int y, int rd, float dir_x, float dir_y)
     return -1;
   //no traffic light
 
-  for (int i = 0; i < map->tlight_sz; i++) {
-    tlight_t *tl = &map->tlight_arr[i];
-    if (tl->road != rd)
+  //only visit the traffic lights of the road, within view along a line
+  int lo = map->tlight_by_road.offs[rd], hi = map->tlight_by_road.offs[rd + 1];
+  if (map->road_arr[rd].kind != RD_ARC) {
+    road_coord_t c;
+    roadCoord(&map->road_arr[rd], x, y, &c);
+    road_bucket_range(&map->tlight_by_road, rd, c.key, TL_VIEW + EPS, &lo, &hi);
+  }
+
+  //the first traffic light in map order wins
+  int first = -1;
+  for (int j = lo; j < hi; j++) {
+    int i = map->tlight_by_road.idx[j];
+    if (first >= 0 && i > first)
       continue;
+    tlight_t *tl = &map->tlight_arr[i];
     double          d = distance(x, y, tl->tl.ptl_pos.x, tl->tl.ptl_pos.y);
 
    /* double        cosdir = dirCos(tl->tl.ptl_pos.y - y, x - tl->tl.ptl_pos.x,
@@ -701,9 +1450,9 @@ int isOnTLight(int x, int y, int rd, float dir_x, float dir_y)
    double           cosdir = dirCos(tl->tl.ptl_pos.x-x, tl->tl.ptl_pos.y-y,
                                     dir_x, dir_y);     //EA
     if (d < TL_VIEW && cosdir > TL_COSDIR)
-      return i;
+      first = i;
   }
-  return -1;
+  return first;
 }
 
 bool isAfterStop(int x, int y, int rid, float dir_x, float dir_y, int* tl)
@@ -715,31 +1464,42 @@ bool isAfterStop(int x, int y, int rid, float dir_x, float dir_y, int* tl)
     return false;
   //no stop points
 
-  for (int i = 0; i < map->stop_sz; i++) {
-    stop_t *sp = &map->stop_arr[i];
-    if (sp->road != rid)
+  // position relative to the road, shared by all its stops
+  road_t *rd = &map->road_arr[rid];
+  road_coord_t c;
+  roadCoord(rd, x, y, &c);
+
+  // only visit the stops close enough along the road
+  double w = STP_AFTER + RD_SIZE_STOP + 2 * EPS;
+  if (rd->kind == RD_ARC)
+    w = todegree(w / rd->u.arc.radius);
+  int lo, hi;
+  road_bucket_range(&map->stop_by_road, rid, c.key, w, &lo, &hi);
+
+  // the first stop in map order within bounds decides
+  int first = -1;
+  bool after = false;
+  for (int j = lo; j < hi; j++) {
+    int i = map->stop_by_road.idx[j];
+    if (first >= 0 && i > first)
       continue;
+    stop_t *sp = &map->stop_arr[i];
     // check the distance to the point
-    road_t *rd = &map->road_arr[sp->road];
     if (rd->kind == RD_LINE_1 ||
         rd->kind == RD_LINE_2) {
       // line
-      // - compute projection on roadline
-      float px = 0.0;
-      float py = 0.0;
-      dirProjPoint(x, y, &(rd->u.line.startp), &(rd->u.line.endp), &px, &py);
-      // - compare with the bounds of the stop point
-      double dsp = distance(px, py, sp->position.x, sp->position.y);
-      double dir_x = px - sp->position.x;
-      double dir_y = py - sp->position.y;
+      // - compare projection on roadline with the bounds of the stop point
+      double dsp = distance(c.px, c.py, sp->position.x, sp->position.y);
+      double dir_x = c.px - sp->position.x;
+      double dir_y = c.py - sp->position.y;
       if (dsp >= (RD_SIZE_STOP-EPS) &&
           dsp <= (STP_AFTER+RD_SIZE_STOP+EPS) &&
           (dirProd(rd->dir_x, rd->dir_y, dir_x, dir_y) >= 0))
         {
           log_debug("[geometry] (%d, %d) is after stop %d (dist %.2f)\n",
                     x, y, i, dsp);
-          (*tl) = sp->sema;
-          return true;
+          first = i;
+          after = true;
         }
       else
         {
@@ -750,52 +1510,41 @@ bool isAfterStop(int x, int y, int rid, float dir_x, float dir_y, int* tl)
     }
     else {
       // arc
-      // -compute angle of point in degrees
-      double apoint = lineAngle(rd->u.arc.center.x, rd->u.arc.center.y,
-                                sp->position.x, sp->position.y);
-      double apos = lineAngle(rd->u.arc.center.x, rd->u.arc.center.y, x, y);
+      // -angles of point and position in degrees
+      double apoint = sp->angle;
+      double apos = c.angle;
       double dsp = toradian(fabs(apoint - apos))*rd->u.arc.radius;
       if (dsp >= (RD_SIZE_STOP-EPS) &&
           dsp <= (STP_AFTER+RD_SIZE_STOP+EPS)) {
         // - check that the direction is AFTER
-        if (fourAnglesInOrder(rd->u.arc.start_angle,
-                              apoint, apos,
-                              rd->u.arc.end_angle))
-            {
-              log_debug("Position AFTER point on arc: %lf!\n", apos);
-              (*tl) = sp->sema;
-              return true;
-            }
-          else
-            {
-              log_debug("Position too far/not AFTER point on arc: %lf!\n", apos);
-              return false;
-            }
+        first = i;
+        after = fourAnglesInOrder(rd->u.arc.start_angle,
+                                  apoint, apos,
+                                  rd->u.arc.end_angle);
+        if (after)
+          log_debug("Position AFTER point on arc: %lf!\n", apos);
+        else
+          log_debug("Position too far/not AFTER point on arc: %lf!\n", apos);
       }
       else {
         log_debug("Position too far/not AFTER point on arc: %lf degrees!\n", apos);
       }
     }
   }
-  return false;
+
+  if (after)
+    (*tl) = map->stop_arr[first].sema;
+  return after;
 }
 
 bool
-isPositionOnPoint(float x, float y, road_t* rd, position_t* p, double pWidth)
+isPositionOnPoint(road_t* rd, road_coord_t* c,
+                  position_t* p, float p_angle, double pWidth)
 {
   if (rd->kind == RD_LINE_1 ||
       rd->kind == RD_LINE_2) { // line
-    // - compute projection on road line
-    float           px = 0.0;
-    float           py = 0.0;
-    position_t      startp = {0, 0};
-    position_t      endp = {0, 0};
-
-    startp = (rd->u.line.startp);
-    endp = (rd->u.line.endp);
-    dirProjPoint(x, y, &(startp), &(endp), &px, &py);
-    // - compare with the bounds of the waypoint
-    double          dwp = distance(px, py, p->x, p->y);
+    // - compare projection on road line with the bounds of the waypoint
+    double          dwp = distance(c->px, c->py, p->x, p->y);
     if (dwp <= pWidth) {
       log_debug("Position near point on line: %lf!\n", dwp);
       return true;
@@ -807,9 +1556,9 @@ isPositionOnPoint(float x, float y, road_t* rd, position_t* p, double pWidth)
   }
   else {
     // arc
-    // - compute angle of point in degrees
-    double apoint = lineAngle(rd->u.arc.center.x, rd->u.arc.center.y, p->x, p->y);
-    double apos = lineAngle(rd->u.arc.center.x, rd->u.arc.center.y, x, y);
+    // - angles of point and position in degrees
+    double apoint = p_angle;
+    double apos = c->angle;
     double dwp = toradian(fabs(apoint - apos))*rd->u.arc.radius;
     if (dwp <= pWidth) {
       log_debug("Position near point on arc: %lf!\n", dwp);
@@ -822,20 +1571,36 @@ isPositionOnPoint(float x, float y, road_t* rd, position_t* p, double pWidth)
   }
 }
 
+/** Range of the elements of road rd in bucket b within pWidth of c */
+void bucketPointRange(const road_bucket_t *b, int rid, road_t *rd,
+                      road_coord_t *c, double pWidth, int *lo, int *hi) {
+  double w = pWidth + 2 * EPS;
+  if (rd->kind == RD_ARC)
+    w = todegree(w / rd->u.arc.radius);
+  road_bucket_range(b, rid, c->key, w, lo, hi);
+}
+
 Globals__color getColorPoint(int rid, float x, float y) {
+  // position relative to the road, shared by all its points
+  road_t *rd = &map->road_arr[rid];
+  road_coord_t c;
+  int lo, hi;
+
+  if (map->wayp_by_road.offs[rid] == map->wayp_by_road.offs[rid + 1]
+      && map->stop_by_road.offs[rid] == map->stop_by_road.offs[rid + 1])
+    return COL_OUT;
+  roadCoord(rd, x, y, &c);
+
   // first go through waypoints
   log_debug("[geometry] looking for waypoints at (%.2f, %.2f) on road %d\n",
             x, y, rid);
-  for (int i = 0; i < map->wayp_sz; i++) {
-    waypoint_t *wp = &map->wayp_arr[i];
-    if (wp->road != rid)
-      {
-        log_debug("Waypoint not on road %d!\n", rid);
-        continue;
-      }
-    road_t *rd = &map->road_arr[wp->road];
+  bucketPointRange(&map->wayp_by_road, rid, rd, &c, RD_SIZE_WAYPOINT,
+                   &lo, &hi);
+  for (int j = lo; j < hi; j++) {
+    waypoint_t *wp = &map->wayp_arr[map->wayp_by_road.idx[j]];
     // waitpoints are ruban
-    if (isPositionOnPoint(x, y, rd, &(wp->position), RD_SIZE_WAYPOINT)) {
+    if (isPositionOnPoint(rd, &c, &wp->position, wp->angle,
+                          RD_SIZE_WAYPOINT)) {
       return COL_WAYPOINT;
       //one waypoint by position
     }
@@ -845,15 +1610,12 @@ Globals__color getColorPoint(int rid, float x, float y) {
   // then go to stop points
   log_debug("[geometry] looking for stops at (%.2f, %.2f) on road %d\n",
             x, y, rid);
-  for (int i = 0; i < map->stop_sz; i++) {
+  bucketPointRange(&map->stop_by_road, rid, rd, &c, RD_SIZE_STOP, &lo, &hi);
+  for (int j = lo; j < hi; j++) {
+    int i = map->stop_by_road.idx[j];
     stop_t *sp = &map->stop_arr[i];
-    if (sp->road != rid) {
-      log_debug("Stop not on road %d!\n", rid);
-      continue;
-    }
-    road_t *rd = &map->road_arr[sp->road];
     // stop points are ruban
-    if (isPositionOnPoint(x, y, rd, &sp->position, RD_SIZE_STOP)) {
+    if (isPositionOnPoint(rd, &c, &sp->position, sp->angle, RD_SIZE_STOP)) {
       log_debug("[geometry] (%.2f, %.2f) at stop %d\n", x, y, i);
       return COL_STOP;
       //one stop by position
@@ -864,7 +1626,313 @@ Globals__color getColorPoint(int rid, float x, float y) {
   return COL_OUT;
 }
 
-void Map__lookup_pos_step(Globals__position pos, Map__lookup_pos_out *o) {
+/*
+ * =========================================================================
+ * Baked lookup raster
+ * =========================================================================
+ */
+
+/* The raster stores, for each cell of the map, the only road that a lookup
+   inside the cell may return (RASTER_OUT if there is none), or
+   RASTER_AMBIGUOUS when several roads compete or a road boundary crosses the
+   cell. Only ambiguous cells need the full search over the spatial index. The
+   road itself is still queried exactly, so results are unchanged. */
+
+#define RASTER_OUT       -1
+#define RASTER_AMBIGUOUS -2
+#define RASTER_MAGIC     "SCRASTER"
+#define RASTER_VERSION   2
+#define RASTER_SUFFIX    ".raster"
+
+typedef struct {
+  char     magic[8];            /* RASTER_MAGIC */
+  uint32_t version;             /* RASTER_VERSION */
+  uint32_t reserved;
+  uint64_t map_hash;            /* FNV-1a hash of the map file contents */
+  float    resolution;          /* size of a cell (in cm) */
+  int32_t  width, height;       /* size of the raster (in cells) */
+  int32_t  road_sz;             /* number of roads at bake time */
+} raster_header_t;
+
+/** Road that is certain to answer every lookup inside the square of center
+    (x, y) and half-size h, RASTER_OUT, or RASTER_AMBIGUOUS. The buffers cand,
+    lo and hi hold one element per road. */
+int16_t raster_classify(float x, float y, float h,
+                        int *cand, double *lo, double *hi) {
+  /* The distance to a road is 1-Lipschitz, up to the EPS tolerances. */
+  double margin = h * M_SQRT2 + DIST_SLACK;
+  int cand_sz = 0;
+
+  /* Gather the roads of the grid cells overlapping the square. */
+  int cx0 = grid_cell(x - h, MIN_X, map->grid_w);
+  int cx1 = grid_cell(x + h, MIN_X, map->grid_w);
+  int cy0 = grid_cell(y - h, MIN_Y, map->grid_h);
+  int cy1 = grid_cell(y + h, MIN_Y, map->grid_h);
+
+  for (int cy = cy0; cy <= cy1; cy++)
+    for (int cx = cx0; cx <= cx1; cx++) {
+      int cell = cy * map->grid_w + cx;
+      for (int i = map->grid_offs[cell]; i < map->grid_offs[cell + 1]; i++) {
+        int rid = map->grid_roads[i];
+        bool known = false;
+        for (int j = 0; j < cand_sz && !known; j++)
+          known = cand[j] == rid;
+        if (known)
+          continue;
+
+        Globals__color col;
+        double d = 700.;
+        float dir_x, dir_y;
+        isOnRoad(&map->road_arr[rid], x, y, &col, &d, &dir_x, &dir_y);
+        if (map->road_arr[rid].kind == RD_LINE_2
+            || d - margin >= RD_SIZE_HALF_WIDTH)
+          continue;             /* never on this road inside the square */
+
+        cand[cand_sz] = rid;
+        lo[cand_sz] = d - margin;
+        hi[cand_sz] = d + margin;
+        cand_sz++;
+      }
+    }
+
+  if (cand_sz == 0)
+    return RASTER_OUT;
+
+  /* Look for a road always on road, and always closer than the others. */
+  for (int i = 0; i < cand_sz; i++) {
+    if (hi[i] >= RD_SIZE_HALF_WIDTH)
+      continue;
+    bool closest = true;
+    for (int j = 0; j < cand_sz && closest; j++)
+      closest = i == j || hi[i] < lo[j];
+    if (closest)
+      return cand[i];
+  }
+
+  return RASTER_AMBIGUOUS;
+}
+
+void raster_bake(int16_t *cells, float res, int w, int h) {
+  int *cand = calloc(map->road_sz + 1, sizeof *cand);
+  double *lo = calloc(map->road_sz + 1, sizeof *lo);
+  double *hi = calloc(map->road_sz + 1, sizeof *hi);
+  assert (cand);
+  assert (lo);
+  assert (hi);
+
+  for (int iy = 0; iy < h; iy++)
+    for (int ix = 0; ix < w; ix++)
+      cells[iy * w + ix] = raster_classify(MIN_X + (ix + 0.5) * res,
+                                           MIN_Y + (iy + 0.5) * res,
+                                           res / 2, cand, lo, hi);
+
+  free(cand);
+  free(lo);
+  free(hi);
+}
+
+/** Map the raster file of filename into memory if it matches header. */
+bool raster_map_file(const char *filename, raster_header_t *header) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  size_t size = sizeof *header
+    + (size_t)header->width * header->height * sizeof *map->raster;
+  struct stat st;
+  void *image = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+    image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (image == MAP_FAILED)
+    return false;
+  if (memcmp(image, header, sizeof *header) != 0) {
+    munmap(image, size);
+    return false;
+  }
+
+  map->raster_image = image;
+  map->raster_image_sz = size;
+  map->raster = (const int16_t *)((char *)image + sizeof *header);
+  return true;
+}
+
+void map_raster_load(const char *filename, float resolution) {
+  assert (map);
+  assert (filename);
+
+  if (resolution <= 0 || resolution > MAP_GRID_CELL)
+    log_fatal("[raster] resolution should be in ]0, %.1f] (got %f)\n",
+              MAP_GRID_CELL, resolution);
+  if (map->road_sz > INT16_MAX) {
+    log_info("[raster] too many roads (%d), not baking\n", map->road_sz);
+    return;
+  }
+
+  raster_header_t header;
+  bzero(&header, sizeof header);
+  memcpy(header.magic, RASTER_MAGIC, sizeof header.magic);
+  header.version = RASTER_VERSION;
+  header.map_hash = map->hash;
+  header.resolution = resolution;
+  header.width = ceil((MAX_X - MIN_X) / resolution);
+  header.height = ceil((MAX_Y - MIN_Y) / resolution);
+  header.road_sz = map->road_sz;
+
+  map->raster_res = resolution;
+  map->raster_w = header.width;
+  map->raster_h = header.height;
+
+  char raster_filename[512];
+  snprintf(raster_filename, sizeof raster_filename, "%s%s",
+           filename, RASTER_SUFFIX);
+
+  if (raster_map_file(raster_filename, &header)) {
+    log_info("[raster] mapped %s (%dx%d cells)\n",
+             raster_filename, header.width, header.height);
+    return;
+  }
+
+  /* Bake the raster, then save it for later runs. */
+  size_t cell_count = (size_t)header.width * header.height;
+  int16_t *cells = calloc(cell_count, sizeof *cells);
+  assert (cells);
+  log_info("[raster] baking %dx%d cells of %.3f cm\n",
+           header.width, header.height, resolution);
+  raster_bake(cells, resolution, header.width, header.height);
+
+  /* Write to a temporary file first, concurrent runs might read it. */
+  char tmp_filename[512 + 16];
+  FILE *f = tmp_file_open(raster_filename, tmp_filename, sizeof tmp_filename);
+  bool saved = f
+    && fwrite(&header, sizeof header, 1, f) == 1
+    && fwrite(cells, sizeof *cells, cell_count, f) == cell_count;
+  if (f)
+    saved = (fclose(f) == 0) && saved;
+  saved = saved && rename(tmp_filename, raster_filename) == 0;
+
+  if (saved && raster_map_file(raster_filename, &header)) {
+    log_info("[raster] saved %s\n", raster_filename);
+    free(cells);
+  } else {
+    log_info("[raster] could not save %s, keeping it in memory\n",
+             raster_filename);
+    if (f)
+      remove(tmp_filename);
+    map->raster = cells;
+  }
+}
+
+/** Raster code at (x, y), RASTER_AMBIGUOUS when there is no raster. */
+static inline int raster_lookup(float x, float y) {
+  if (!map->raster)
+    return RASTER_AMBIGUOUS;
+
+  int ix = floorf((x - MIN_X) / map->raster_res);
+  int iy = floorf((y - MIN_Y) / map->raster_res);
+  if (ix < 0 || ix >= map->raster_w || iy < 0 || iy >= map->raster_h)
+    return RASTER_AMBIGUOUS;
+  return map->raster[iy * map->raster_w + ix];
+}
+
+/** Road at (x, y) by a full search over the roads of its grid cell, -1 if
+    none, along with the radius of a disc around (x, y) where the search is
+    sure to give the same answer (<= 0 if there is no such disc). */
+int search_road(float x, float y, float *safe_radius) {
+  int cx = grid_cell(x, MIN_X, map->grid_w);
+  int cy = grid_cell(y, MIN_Y, map->grid_h);
+  int cell = cy * map->grid_w + cx;
+
+  /* Closest road on road, second closest on road, and closest off road. */
+  int min_rd = -1;
+  double min_d = 700., second_d = 700., off_d = 700.;
+  float lb[64];
+  for (int i0 = map->grid_offs[cell]; i0 < map->grid_offs[cell + 1]; i0 += 64) {
+    /* Only run the exact test on roads which may be close enough. */
+    int n = fmin(64, map->grid_offs[cell + 1] - i0);
+    road_soa_lower_bounds(&map->grid_soa, i0, n, x, y, lb);
+
+    for (int i = 0; i < n; i++) {
+      if (lb[i] >= RD_SIZE_HALF_WIDTH + DIST_SLACK) {
+        off_d = fmin(off_d, lb[i] - EPS);
+        continue;
+      }
+
+      int rid = map->grid_roads[i0 + i];
+      road_t *rd = &map->road_arr[rid];
+      double d = 0.;
+      Globals__color col = COL_OUT;
+      float dir_X = 0.0;
+      float dir_Y = 0.0;
+      bool onRoad = isOnRoad(rd, x, y, &col, &d, &dir_X, &dir_Y);
+
+      if (!onRoad)
+        off_d = fmin(off_d, d);
+      else if (d < min_d) {
+        second_d = min_d;
+        min_d = d;
+        min_rd = rid;
+      } else
+        second_d = fmin(second_d, d);
+    }
+  }
+
+  /* Roads outside of the cell do not reach it. */
+  double r = fmin(fmin(x - (MIN_X + cx * MAP_GRID_CELL),
+                       MIN_X + (cx + 1) * MAP_GRID_CELL - x),
+                  fmin(y - (MIN_Y + cy * MAP_GRID_CELL),
+                       MIN_Y + (cy + 1) * MAP_GRID_CELL - y));
+
+  /* Roads stay off road, or the closest road stays on road and closer than
+     the others. */
+  if (min_rd < 0)
+    r = fmin(r, off_d - RD_SIZE_HALF_WIDTH - DIST_SLACK);
+  else {
+    r = fmin(r, RD_SIZE_HALF_WIDTH - min_d - DIST_SLACK);
+    r = fmin(r, (second_d - min_d) / 2 - DIST_SLACK);
+    r = fmin(r, fmax(off_d - RD_SIZE_HALF_WIDTH,
+                     (off_d - min_d) / 2) - DIST_SLACK);
+  }
+
+  *safe_radius = r;
+  return min_rd;
+}
+
+/** Road found at (x, y), -1 if none. */
+int road_at(float x, float y) {
+  /* The raster knows the answer, except in ambiguous cells. */
+  int code = raster_lookup(x, y);
+  if (code != RASTER_AMBIGUOUS)
+    return code >= 0 ? code : -1;
+
+  /* The car moves a fraction of a centimeter per tick, so the point is
+     likely to be close to a recent one. */
+  map_coherence_t *co = &map->coherence;
+  for (int i = 0; i < co->sz; i++) {
+    float dx = x - co->center[i].x, dy = y - co->center[i].y;
+    if (dx * dx + dy * dy < co->radius[i] * co->radius[i]) {
+      co->hits++;
+      return co->road[i];
+    }
+  }
+
+  float r;
+  int rid = search_road(x, y, &r);
+  co->misses++;
+  if (r > 0) {
+    co->center[co->next] = (position_t){ x, y };
+    co->radius[co->next] = r;
+    co->road[co->next] = rid;
+    co->next = (co->next + 1) % MAP_COHERENCE_SIZE;
+    if (co->sz < MAP_COHERENCE_SIZE)
+      co->sz++;
+  }
+  return rid;
+}
+
+/** Exact lookup of the map data at pos */
+void map_lookup(Globals__position pos, Map__lookup_pos_out *o) {
   float x = pos.x, y = pos.y;
 
   o->data.on_road = false;
@@ -876,51 +1944,31 @@ void Map__lookup_pos_step(Globals__position pos, Map__lookup_pos_out *o) {
   o->data.dir_y = 0.0;
 
   log_debug("[geometry] querying pos (%.2f, %.2f)\n", x, y);
-  if (map == NULL)
-    log_fatal("[geometry] map has not been initialized\n");
 
-  int min_rd = -1;
-  double min_d = 700.;
-  for (int rid = 0; rid < map->road_sz; rid++) {
-    road_t *rd = &map->road_arr[rid];
+  int min_rd = road_at(x, y);
+  if (min_rd >= 0) {
+    road_t *rd = &map->road_arr[min_rd];
     double d = 0.;
     Globals__color col = COL_OUT;
-    bool onRoad = false;
     float dir_X = 0.0;
     float dir_Y = 0.0;
-    switch (rd->kind) {
-    case RD_LINE_1:
-      onRoad = isOnRoadLine1(rd, x, y, &col, &d, &dir_X, &dir_Y);
-      break;
-    case RD_LINE_2:
-      onRoad = isOnRoadLine2(rd, x, y, &col, &d, &dir_X, &dir_Y);
-      break;
-    case RD_ARC:
-      onRoad = isOnRoadArc(rd, x, y, &col, &d, &dir_X, &dir_Y);
-      break;
-    case RD_OTHER:
-      break;
+    isOnRoad(rd, x, y, &col, &d, &dir_X, &dir_Y);
+
+    o->data.color = col;
+    o->data.dir_x = dir_X;
+    o->data.dir_y = dir_Y;
+    o->data.max_speed = rd->max_speed;
+    /* Update color when a waypoint or stop. */
+    col = getColorPoint(min_rd, x, y);
+    if (colors_equal(&col, &COL_OUT))
+      o->data.color = o->data.color;
+    else if (colors_equal(&col, &COL_STOP)) {
+      /* TODO: update red color */
+      o->data.color = col;
     }
-
-    if (onRoad && (d < min_d)) {
-      min_d = d;
-      min_rd = rid;
+    else {
+      /* TODO: update green color */
       o->data.color = col;
-      o->data.dir_x = dir_X;
-      o->data.dir_y = dir_Y;
-      o->data.max_speed = map->road_arr[min_rd].max_speed;
-      /* Update color when a waypoint or stop. */
-      col = getColorPoint(rid, x, y);
-      if (colors_equal(&col, &COL_OUT))
-        o->data.color = o->data.color;
-      else if (colors_equal(&col, &COL_STOP)) {
-        /* TODO: update red color */
-        o->data.color = col;
-      }
-      else {
-        /* TODO: update green color */
-        o->data.color = col;
-      }
     }
   }
 
@@ -950,6 +1998,60 @@ void Map__lookup_pos_step(Globals__position pos, Map__lookup_pos_out *o) {
             o->data.tl_number, o->data.tl_required);
 }
 
+/** Lookup of the map data at pos, numbering traffic lights as in the map */
+void map_lookup_memo(Globals__position pos, Map__lookup_pos_out *o) {
+  if (map == NULL)
+    log_fatal("[geometry] map has not been initialized\n");
+
+  /* The same points are queried several times per synchronous step, the map
+     does not change, so remember the most recent answers. */
+  map_memo_t *memo = &map->memo;
+  for (int i = 0; i < memo->sz; i++)
+    if (memcmp(&memo->pos[i], &pos, sizeof pos) == 0) {
+      memo->hits++;
+      o->data = memo->data[i];
+      return;
+    }
+
+  memo->misses++;
+  map_lookup(pos, o);
+
+  memo->pos[memo->next] = pos;
+  memo->data[memo->next] = o->data;
+  memo->next = (memo->next + 1) % MAP_MEMO_SIZE;
+  if (memo->sz < MAP_MEMO_SIZE)
+    memo->sz++;
+}
+
+void Map__lookup_pos_step(Globals__position pos, Map__lookup_pos_out *o) {
+  map_lookup_memo(pos, o);
+
+  /* Number the traffic light as in the view of the synchronous program,
+     which is that of the car position, as pos. A light out of view cannot
+     be checked, so it is not required. */
+  o->data.tl_number = tlight_view_index(pos, o->data.tl_number);
+  if (o->data.tl_number < 0)
+    o->data.tl_required = false;
+}
+
+/** Lookup of n positions at once, such as the points of the car footprint */
+void map_lookup_n(const position_t *pos, size_t n, Globals__map_data *data) {
+  Map__lookup_pos_out o;
+
+  /* Traffic lights are only numbered in the view of the car position, so
+     that the view is computed once per step. */
+  for (size_t i = 0; i < n; i++) {
+    map_lookup_memo(pos[i], &o);
+    data[i] = o.data;
+    data[i].tl_number = -1;
+    data[i].tl_required = false;
+  }
+}
+
+DEFINE_HEPT_FUN(Map, lookup_pos_n, (Globals__position *pos)) {
+  map_lookup_n(pos, Globals__footnum, out->data);
+}
+
 
 void play_asset_wav(SDL_AudioDeviceID audio_device, asset_wav_t *wav) {
   if (!audio_device) {
@@ -961,6 +2063,8 @@ void play_asset_wav(SDL_AudioDeviceID audio_device, asset_wav_t *wav) {
     log_fatal("[sdl] could not queue audio\n");
 }
 
+/* Sounds are loaded and the audio device opened once by the graphical loop,
+   races running on other threads only read them. */
 asset_wav_t collision, wrong_dir, exit_road, light_run, speed_excess;
 SDL_AudioDeviceID audio_device = 0;
 
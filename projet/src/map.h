@@ -3,6 +3,7 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -12,12 +13,14 @@
 #include "hept_ffi.h"
 #include "globals_types.h"
 
-#define MAX_ROAD_COUNT  50               /* maximum number of roads */
-#define MAX_WAYP_COUNT  50               /* maximum number of waypoints */
-#define MAX_TL_COUNT    Globals__trafnum /* maximum number of traffic lights */
-#define MAX_STOP_COUNT  50               /* maximum number of stops */
-#define MAX_OBST_COUNT  Globals__obstnum /* maximum number of obstacles */
+/* Maps may hold any number of roads, waypoints, stops, traffic lights and
+   obstacles. The synchronous program only sees a window of the traffic lights
+   and obstacles nearest to the car, see map_view_t. */
+#define MAX_TL_COUNT    Globals__trafnum /* traffic lights in view */
+#define MAX_OBST_COUNT  Globals__obstnum /* obstacles in view */
 #define MAX_ITI_COUNT   Globals__itinum  /* maximum number of itinerary steps */
+#define MAX_VIEW_COUNT  (MAX_TL_COUNT > MAX_OBST_COUNT \
+                         ? MAX_TL_COUNT : MAX_OBST_COUNT)
 
 /*
  * =========================================================================
@@ -34,6 +37,15 @@
 /** Precision of comparison between points */
 #define EPS 0.001
 
+/** Size of the cells of the spatial index over roads (in cm) */
+#define MAP_GRID_CELL 10.0
+
+/** Number of recent lookups remembered, a tick queries a handful of points */
+#define MAP_MEMO_SIZE 4
+
+/** Number of recent regions where the road found is known not to change */
+#define MAP_COHERENCE_SIZE 4
+
 /** Type of points used, in a Carthesian space */
 /** see @code{positionTy} in kcg_types.h */
 
@@ -134,6 +146,8 @@ typedef enum {
 
 typedef Globals__phase phase_t;
 
+typedef Globals__position position_t;
+
 /** Road segment */
 typedef struct {
   road_kind_t  kind;           /* kind to select informations */
@@ -154,12 +168,27 @@ typedef struct {
       float             end_angle;
     } arc;
   } u;
+
+  struct {                      /* precomputed when loading the road */
+    float        ux, uy;        /* unit direction of a line */
+    float        inv_len;       /* inverse of the length of a line */
+    float        xmin, ymin;    /* bounding box of the middle line */
+    float        xmax, ymax;
+    position_t   arc_startp;    /* extremities of an arc */
+    position_t   arc_endp;
+    float        arc_first_x;   /* unit vector of the first angle of an arc */
+    float        arc_first_y;   /*   in counterclockwise order */
+    float        arc_last_x;    /* unit vector of the last angle of an arc */
+    float        arc_last_y;    /*   in counterclockwise order */
+    float        arc_span;      /* angular span of an arc (in degree) */
+  } geo;
 } road_t;
 
 /** Waypoint used to consult the map */
 typedef struct {
   int                   road;     /* road identifier */
   Globals__position     position; /* on the middle line of the road */
+  float                 angle;    /* angle around the center of an arc road */
 } waypoint_t;
 
 /** Stop point used to signal a traffic light */
@@ -167,6 +196,7 @@ typedef struct {
   int                   road;     /* road identifier */
   int                   sema;     /* traffic light identifier */
   Globals__position     position; /* on the middle line of a road */
+  float                 angle;    /* angle around the center of an arc road */
 } stop_t;
 
 /** Traffic lights: added road reference to type
@@ -176,24 +206,73 @@ typedef struct {
   int                   road;   /* road identifier that the tlight controls */
 } tlight_t;
 
+/** Elements of one kind grouped by road, in CSR format: the elements on road
+ *  r are idx[offs[r]] to idx[offs[r + 1] - 1], sorted by their position along
+ *  the road (distance from the start of a line, angle around an arc center) */
+typedef struct {
+  int                   *offs;  /* road_sz + 1 offsets in idx and key */
+  int                   *idx;   /* element identifiers */
+  float                 *key;   /* position of the elements along the road */
+} road_bucket_t;
+
+/** Roads of the spatial index in SoA layout, entry i standing for road
+ *  grid_roads[i]: the road is approximated by the points at distance r of the
+ *  segment going from a to a + len * u (r = 0 for lines, len = 0 for arcs) */
+typedef struct {
+  float                 *ax, *ay;  /* start of a line, center of an arc */
+  float                 *ux, *uy;  /* unit direction of a line */
+  float                 *len;      /* length of a line */
+  float                 *r;        /* radius of an arc */
+} road_soa_t;
+
 typedef Globals__param_obst obst_t;
 
 typedef Globals__itielt iti_t;
 
-typedef Globals__position position_t;
-
 /*
  * =========================================================================
  * Maps
  * =========================================================================
  */
 
+/** Recent lookups, returned again when the same position is queried */
+typedef struct {
+  position_t           pos[MAP_MEMO_SIZE];  /* Queried positions */
+  Globals__map_data    data[MAP_MEMO_SIZE]; /* Their results */
+  int                  sz;                  /* Number of valid entries */
+  int                  next;                /* Next entry to replace */
+  size_t               hits;                /* Lookups found in the memo */
+  size_t               misses;              /* Lookups computed */
+} map_memo_t;
+
+/** Discs around recent lookups where the same road (or none) is found */
+typedef struct {
+  position_t           center[MAP_COHERENCE_SIZE]; /* Queried positions */
+  float                radius[MAP_COHERENCE_SIZE]; /* Safe radius (in cm) */
+  int                  road[MAP_COHERENCE_SIZE];   /* Road found, or -1 */
+  int                  sz;                         /* Valid entries */
+  int                  next;                       /* Next entry to replace */
+  size_t               hits;                       /* Searches avoided */
+  size_t               misses;                     /* Searches performed */
+} map_coherence_t;
+
+/** Elements in view from a position, by increasing identifiers: the nearest
+ *  ones when the map holds more elements than the synchronous program sees,
+ *  all of them otherwise */
+typedef struct {
+  position_t           pos;                 /* Position of the view */
+  float                time;                /* Time of the view (obstacles) */
+  int                  sz;                  /* Elements in view, -1 if unset */
+  int                  ids[MAX_VIEW_COUNT]; /* Their identifiers */
+} map_view_t;
+
 /** One map contains roads, waypoints, traffic lights and stop points */
 typedef struct {
   char                 name[255];     /* Name of the map */
   char                 graphics[255]; /* Path to graphics file (bmp) */
   char                 guide[255];    /* Path to guide file (bmp) */
   phase_t              init_phase;    /* Initial phase of the robot */
+  uint64_t             hash;          /* FNV-1a hash of the map file */
   road_t               *road_arr;     /* Roads */
   int                  tlight_sz;     /* Road count */
   waypoint_t           *wayp_arr;     /* Waypoints */
@@ -206,12 +285,35 @@ typedef struct {
   int                  obst_sz;       /* Obstacle count */
   iti_t                *iti_arr;      /* Itinerary */
   int                  iti_sz;        /* Itinerary step count */
+  int                  grid_w;        /* Spatial index width (in cells) */
+  int                  grid_h;        /* Spatial index height (in cells) */
+  int                  *grid_offs;    /* Start of each cell in grid_roads */
+  int                  *grid_roads;   /* Roads overlapping each cell */
+  road_soa_t           grid_soa;      /* Geometry of grid_roads */
+  road_bucket_t        wayp_by_road;  /* Waypoints of each road */
+  road_bucket_t        tlight_by_road;/* Traffic lights of each road */
+  road_bucket_t        stop_by_road;  /* Stops of each road */
+  float                raster_res;    /* Raster cell size (in cm) */
+  int                  raster_w;      /* Raster width (in cells) */
+  int                  raster_h;      /* Raster height (in cells) */
+  const int16_t        *raster;       /* Baked road of each cell, or NULL */
+  void                 *raster_image; /* Memory-mapped raster file */
+  size_t               raster_image_sz;
+  void                 *image;        /* Memory-mapped compiled map */
+  size_t               image_sz;
+  map_view_t           tlight_view;   /* Last traffic lights in view */
+  map_view_t           obst_view;     /* Last obstacles in view */
+  map_memo_t           memo;          /* Recent lookups */
+  map_coherence_t      coherence;     /* Recent safe regions */
 } map_t;
 
-extern map_t *map;
+extern _Thread_local map_t *map; /* map of the race of the current thread */
 
 void map_load(const char *);  /* parse and load global map file */
 void map_destroy();           /* free the map loaded via load_map() */
+void map_compile(const char *); /* save the loaded map as a compiled map */
+void map_raster_load(const char *, float); /* bake or map lookup raster */
+void map_lookup_n(const position_t *, size_t, Globals__map_data *);
 
 /*
  * =========================================================================
@@ -228,12 +330,14 @@ typedef struct asset_wav {
 extern asset_wav_t collision, wrong_dir, exit_road, light_run, speed_excess;
 extern SDL_AudioDeviceID audio_device;
 
-DECLARE_HEPT_FUN_NULLARY(Map,
-                         read_obstacles,
-                         Globals__param_obsts obst);
-DECLARE_HEPT_FUN_NULLARY(Map,
-                         read_traffic_lights,
-                         Globals__param_tlights tlights);
+DECLARE_HEPT_FUN(Map,
+                 read_obstacles,
+                 (Globals__position, float),
+                 Globals__param_obsts obst);
+DECLARE_HEPT_FUN(Map,
+                 read_traffic_lights,
+                 (Globals__position),
+                 Globals__param_tlights tlights);
 DECLARE_HEPT_FUN_NULLARY(Map,
                          read_itinerary,
                          Globals__itielts iti);
@@ -241,6 +345,10 @@ DECLARE_HEPT_FUN(Map,
                  lookup_pos,
                  (Globals__position),
                  Globals__map_data data);
+DECLARE_HEPT_FUN(Map,
+                 lookup_pos_n,
+                 (Globals__position *),
+                 Globals__map_data data[Globals__footnum]);
 DECLARE_HEPT_FUN(Map,
                  soundEffects,
                  (Globals__event, Globals__status),);
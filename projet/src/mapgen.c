@@ -0,0 +1,471 @@
+/* This file is part of SyncContest.
+   Copyright (C) 2017-2020 Eugene Asarin, Mihaela Sighireanu, Adrien Guatto. */
+
+/* Generator of synthetic city maps, used to measure how map loading and
+   lookups scale with the size of the map. The streets form a grid of one-way
+   roads of alternating directions, as in the nycity map, where some
+   intersections are replaced by roundabouts, as in the roundabout map. The
+   itinerary follows a random walk through the city, so it is always
+   solvable. The same seed always produces the same map. */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutils.h"
+#include "map.h"
+
+#define MARGIN       25.0       /* distance between the city and the border */
+#define STOP_BEFORE  15.0       /* distance of stop lines to the road end */
+#define WAYP_BEFORE   2.0       /* distance of waypoints to the road end */
+#define TL_SIDE       5.0       /* distance of traffic lights to the road */
+
+typedef struct {
+  bool    arc;                  /* arc or line */
+  int     speed;                /* maximal speed */
+  float   ax, ay, bx, by;       /* extremities of a line */
+  float   cx, cy, r, a0, a1;    /* center, radius and angles of an arc */
+  int     from, to;             /* junctions at the extremities */
+  bool    on_route;             /* used by the itinerary */
+} groad_t;
+
+typedef struct {
+  int     cols, rows;           /* intersections of the grid */
+  float   block;                /* distance between intersections (in cm) */
+  int     split;                /* roads per street between intersections */
+  int     roundabouts;          /* intersections replaced by roundabouts */
+  int     tlights;              /* traffic lights */
+  int     obstacles;            /* obstacles */
+  int     steps;                /* maximum itinerary length */
+  uint64_t seed;                /* random seed */
+} gen_params_t;
+
+static groad_t *roads;
+static int road_sz, road_cap;
+static int junction_sz;
+
+/* SplitMix64, so that seeds give the same maps on every libc. */
+static uint64_t rng_state;
+
+uint64_t rng_next() {
+  uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+int rng_int(int n) {
+  return rng_next() % n;
+}
+
+int junction_new() {
+  return junction_sz++;
+}
+
+groad_t *road_new(int from, int to, int speed) {
+  if (road_sz == road_cap) {
+    road_cap = road_cap ? 2 * road_cap : 256;
+    roads = realloc(roads, road_cap * sizeof *roads);
+    if (!roads)
+      log_fatal("[mapgen] out of memory\n");
+  }
+  groad_t *rd = &roads[road_sz++];
+  memset(rd, 0, sizeof *rd);
+  rd->from = from;
+  rd->to = to;
+  rd->speed = speed;
+  return rd;
+}
+
+/** Heading (in degree) of road rd at its start or at its end */
+float road_heading(const groad_t *rd, bool end) {
+  if (!rd->arc)
+    return atan2f(rd->by - rd->ay, rd->bx - rd->ax) * 180.0 / M_PI;
+  /* Arcs are generated with increasing angles. */
+  return (end ? rd->a1 : rd->a0) + 90.0;
+}
+
+float road_length(const groad_t *rd) {
+  if (rd->arc)
+    return rd->r * (rd->a1 - rd->a0) * M_PI / 180.0;
+  return hypotf(rd->bx - rd->ax, rd->by - rd->ay);
+}
+
+/** Distance of the stop line of road rd to its end */
+float stop_before(const groad_t *rd) {
+  return fminf(STOP_BEFORE, road_length(rd) / 2);
+}
+
+/** Point of road rd at distance d before its end */
+void road_point_before_end(const groad_t *rd, float d, float *x, float *y) {
+  if (rd->arc) {
+    float a = (rd->a1 - d / rd->r * 180.0 / M_PI) * M_PI / 180.0;
+    *x = rd->cx + rd->r * cosf(a);
+    *y = rd->cy + rd->r * sinf(a);
+  } else {
+    float l = road_length(rd);
+    *x = rd->bx - (rd->bx - rd->ax) * d / l;
+    *y = rd->by - (rd->by - rd->ay) * d / l;
+  }
+}
+
+/** Street of split line roads from junction from at (ax, ay) to junction to
+    at (bx, by) */
+void street_new(int from, float ax, float ay, int to, float bx, float by,
+                int split, int speed) {
+  for (int i = 0; i < split; i++) {
+    int j = (i == split - 1) ? to : junction_new();
+    groad_t *rd = road_new(from, j, speed);
+    rd->ax = ax + (bx - ax) * i / split;
+    rd->ay = ay + (by - ay) * i / split;
+    rd->bx = ax + (bx - ax) * (i + 1) / split;
+    rd->by = ay + (by - ay) * (i + 1) / split;
+    from = j;
+  }
+}
+
+/** Build the city: intersections are junctions, roundabouts are rings of
+    four arcs joining the junctions of their four cardinal points. */
+void city_build(const gen_params_t *p) {
+  int n = p->cols * p->rows;
+  float ring = p->block / 4;
+  int *center = calloc(n, sizeof *center);
+  int (*cardinal)[4] = calloc(n, sizeof *cardinal); /* E, N, W, S */
+  bool *is_ring = calloc(n, sizeof *is_ring);
+  if (!center || !cardinal || !is_ring)
+    log_fatal("[mapgen] out of memory\n");
+
+  /* Roundabouts avoid the border, so that every ring has four streets. */
+  int inner = (p->cols - 2) * (p->rows - 2);
+  for (int k = 0; k < p->roundabouts && k < inner; k++) {
+    int c;
+    do
+      c = (1 + rng_int(p->rows - 2)) * p->cols + 1 + rng_int(p->cols - 2);
+    while (is_ring[c]);
+    is_ring[c] = true;
+  }
+
+  for (int c = 0; c < n; c++) {
+    float x = MARGIN + (c % p->cols) * p->block;
+    float y = MARGIN + (c / p->cols) * p->block;
+    if (!is_ring[c]) {
+      center[c] = junction_new();
+      for (int k = 0; k < 4; k++)
+        cardinal[c][k] = center[c];
+      continue;
+    }
+
+    for (int k = 0; k < 4; k++)
+      cardinal[c][k] = junction_new();
+    for (int k = 0; k < 4; k++) {
+      groad_t *rd = road_new(cardinal[c][k], cardinal[c][(k + 1) % 4], 10);
+      rd->arc = true;
+      rd->cx = x;
+      rd->cy = y;
+      rd->r = ring;
+      rd->a0 = k == 3 ? -90.0 : k * 90.0;
+      rd->a1 = rd->a0 + 90.0;
+    }
+  }
+
+  /* One-way streets, of alternating directions, between intersections. */
+  for (int row = 0; row < p->rows; row++)
+    for (int col = 0; col + 1 < p->cols; col++) {
+      int w = row * p->cols + col, e = w + 1;
+      float y = MARGIN + row * p->block;
+      float xw = MARGIN + col * p->block + (is_ring[w] ? ring : 0);
+      float xe = MARGIN + (col + 1) * p->block - (is_ring[e] ? ring : 0);
+      int speed = (row % 3 == 0) ? 30 : 20;
+      if (row % 2 == 0)
+        street_new(cardinal[w][0], xw, y, cardinal[e][2], xe, y,
+                   p->split, speed);
+      else
+        street_new(cardinal[e][2], xe, y, cardinal[w][0], xw, y,
+                   p->split, speed);
+    }
+  for (int col = 0; col < p->cols; col++)
+    for (int row = 0; row + 1 < p->rows; row++) {
+      int s = row * p->cols + col, t = s + p->cols;
+      float x = MARGIN + col * p->block;
+      float ys = MARGIN + row * p->block + (is_ring[s] ? ring : 0);
+      float yt = MARGIN + (row + 1) * p->block - (is_ring[t] ? ring : 0);
+      int speed = (col % 3 == 0) ? 30 : 20;
+      if (col % 2 == 0)
+        street_new(cardinal[s][1], x, ys, cardinal[t][3], x, yt,
+                   p->split, speed);
+      else
+        street_new(cardinal[t][3], x, yt, cardinal[s][1], x, ys,
+                   p->split, speed);
+    }
+
+  free(center);
+  free(cardinal);
+  free(is_ring);
+}
+
+/** Turn between two consecutive line roads, in ]-180, 180] */
+float turn_angle(const groad_t *a, const groad_t *b) {
+  float t = road_heading(b, false) - road_heading(a, true);
+  while (t <= -180.0)
+    t += 360.0;
+  while (t > 180.0)
+    t -= 360.0;
+  return t;
+}
+
+/** Whether the itinerary turns from road prev to road cur: entering and
+    leaving a roundabout both turn right, going round it goes on, as in the
+    roundabout map. */
+bool route_turns(const groad_t *prev, const groad_t *cur) {
+  if (cur->arc || prev->arc)
+    return cur->arc != prev->arc;
+  return fabsf(turn_angle(prev, cur)) > 1.0;
+}
+
+/** Random walk from a random line road, stored in route, returning the
+    number of itinerary steps it needs. */
+int route_build(const gen_params_t *p, int *route, int *route_sz) {
+  int cur;
+  do
+    cur = rng_int(road_sz);
+  while (roads[cur].arc);
+
+  int steps = 2;                /* first go, and final stop */
+  *route_sz = 0;
+  route[(*route_sz)++] = cur;
+  roads[cur].on_route = true;
+
+  int *next = calloc(road_sz, sizeof *next);
+  if (!next)
+    log_fatal("[mapgen] out of memory\n");
+  while (true) {
+    int next_sz = 0;
+    for (int i = 0; i < road_sz; i++)
+      if (roads[i].from == roads[cur].to)
+        next[next_sz++] = i;
+    if (next_sz == 0)
+      break;
+
+    /* One go, plus one turn, including when entering or leaving a
+       roundabout. */
+    int nxt = next[rng_int(next_sz)];
+    int cost = 1 + route_turns(&roads[cur], &roads[nxt]);
+    if (steps + cost > p->steps)
+      break;
+    steps += cost;
+    route[(*route_sz)++] = cur = nxt;
+    roads[cur].on_route = true;
+  }
+  free(next);
+
+  return steps;
+}
+
+/** Itinerary of the route, one step per road and one per turn */
+void itinerary_write(FILE *f, const int *route, int route_sz) {
+  fprintf(f, "go %d.\n", roads[route[0]].speed);
+  for (int i = 1; i < route_sz; i++) {
+    groad_t *prev = &roads[route[i - 1]], *cur = &roads[route[i]];
+    if (route_turns(prev, cur))
+      fprintf(f, "turn %.0f.\n",
+              cur->arc || prev->arc ? -90.0 : turn_angle(prev, cur));
+    fprintf(f, "go %d.\n", cur->speed);
+  }
+  fprintf(f, "stop 0.\n");
+}
+
+void map_write(FILE *f, const char *name,
+               const int *route, int route_sz, int steps,
+               const int *tl_roads, int tl_sz,
+               const int *obst_roads, int obst_sz) {
+  groad_t *first = &roads[route[0]];
+  float l = road_length(first), d = fminf(10.0, l / 2);
+
+  fprintf(f, "map \"%s\"\n", name);
+  fprintf(f, "graphics \"map_08_nycity.bmp\"\n");
+  fprintf(f, "guide \"b-08.bmp\"\n");
+  fprintf(f, "init %.2f %.2f %.0f.\n",
+          first->ax + (first->bx - first->ax) * d / l,
+          first->ay + (first->by - first->ay) * d / l,
+          road_heading(first, false));
+
+  fprintf(f, "rd %d\n", road_sz);
+  for (int i = 0; i < road_sz; i++) {
+    groad_t *rd = &roads[i];
+    if (rd->arc)
+      fprintf(f, "arc  1 %d %.2f %.2f %.2f %.0f. %.0f.\n", rd->speed,
+              rd->cx, rd->cy, rd->r, rd->a0, rd->a1);
+    else
+      fprintf(f, "line 1 %d %.2f %.2f %.2f %.2f\n", rd->speed,
+              rd->ax, rd->ay, rd->bx, rd->by);
+  }
+
+  /* One waypoint at the end of each road, where the next step starts. */
+  fprintf(f, "wp %d\n", road_sz);
+  for (int i = 0; i < road_sz; i++) {
+    float x, y;
+    road_point_before_end(&roads[i], WAYP_BEFORE, &x, &y);
+    fprintf(f, "%d %.2f %.2f\n", i, x, y);
+  }
+
+  /* Traffic lights on the side of the end of roads, at their stop line. */
+  fprintf(f, "tl %d\n", tl_sz);
+  for (int i = 0; i < tl_sz; i++) {
+    groad_t *rd = &roads[tl_roads[i]];
+    float x, y, h = road_heading(rd, true) * M_PI / 180.0;
+    road_point_before_end(rd, stop_before(rd), &x, &y);
+    fprintf(f, "%d %.2f %.2f %d %d %d %d\n", tl_roads[i],
+            x + TL_SIDE * sinf(h), y - TL_SIDE * cosf(h),
+            3 + rng_int(5), 3, 3 + rng_int(5), rng_int(10));
+  }
+  fprintf(f, "st %d\n", tl_sz);
+  for (int i = 0; i < tl_sz; i++) {
+    float x, y;
+    road_point_before_end(&roads[tl_roads[i]], stop_before(&roads[tl_roads[i]]),
+                          &x, &y);
+    fprintf(f, "%d %d %.2f %.2f\n", tl_roads[i], i, x, y);
+  }
+
+  /* Obstacles in the middle of roads away from the itinerary. */
+  fprintf(f, "obst %d\n", obst_sz);
+  for (int i = 0; i < obst_sz; i++) {
+    groad_t *rd = &roads[obst_roads[i]];
+    float since = rng_int(60);
+    fprintf(f, "%.2f %.2f %.0f. %.0f.\n", (rd->ax + rd->bx) / 2,
+            (rd->ay + rd->by) / 2, since, since + 10 + rng_int(60));
+  }
+
+  fprintf(f, "iti %d\n", steps);
+  itinerary_write(f, route, route_sz);
+  fprintf(f, "end\n");
+}
+
+/** Up to n distinct roads satisfying ok, in random order */
+int pick_roads(int n, bool (*ok)(const groad_t *), int *out) {
+  int cand_sz = 0;
+  for (int i = 0; i < road_sz; i++)
+    if (ok(&roads[i]))
+      out[cand_sz++] = i;
+  for (int i = 0; i < cand_sz && i < n; i++) {
+    int j = i + rng_int(cand_sz - i), t = out[i];
+    out[i] = out[j];
+    out[j] = t;
+  }
+  return cand_sz < n ? cand_sz : n;
+}
+
+bool tlight_road(const groad_t *rd) {
+  return !rd->arc && road_length(rd) > 2 * WAYP_BEFORE;
+}
+
+bool obstacle_road(const groad_t *rd) {
+  return !rd->arc && !rd->on_route;
+}
+
+void usage() {
+  fprintf(stderr, "Usage: mapgen [OPTIONS] out\n");
+  fprintf(stderr, "Writes out.map and out.iti\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -x <n>          Intersections per row (default: 11)\n");
+  fprintf(stderr, "  -y <n>          Intersections per column (default: 5)\n");
+  fprintf(stderr, "  -b <cm>         Distance between intersections (default: 50)\n");
+  fprintf(stderr, "  -s <n>          Roads per street (default: 1)\n");
+  fprintf(stderr, "  -r <n>          Roundabouts (default: 2)\n");
+  fprintf(stderr, "  -l <n>          Traffic lights (default: 6)\n");
+  fprintf(stderr, "  -o <n>          Obstacles (default: 10)\n");
+  fprintf(stderr, "  -n <n>          Maximum itinerary steps (default: %d)\n",
+          MAX_ITI_COUNT);
+  fprintf(stderr, "  -S <seed>       Random seed (default: 1)\n");
+  fprintf(stderr, "  -h              Display this message\n");
+}
+
+int main(int argc, char **argv) {
+  gen_params_t p = { 11, 5, 50.0, 1, 2, 6, 10, MAX_ITI_COUNT, 1 };
+  int opt;
+
+  while ((opt = getopt(argc, argv, "x:y:b:s:r:l:o:n:S:h")) != -1) {
+    switch (opt) {
+    case 'x': p.cols = atoi(optarg); break;
+    case 'y': p.rows = atoi(optarg); break;
+    case 'b': p.block = atof(optarg); break;
+    case 's': p.split = atoi(optarg); break;
+    case 'r': p.roundabouts = atoi(optarg); break;
+    case 'l': p.tlights = atoi(optarg); break;
+    case 'o': p.obstacles = atoi(optarg); break;
+    case 'n': p.steps = atoi(optarg); break;
+    case 'S': p.seed = strtoull(optarg, NULL, 10); break;
+    case 'h':
+      usage();
+      return EXIT_SUCCESS;
+    default:
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind >= argc) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  log_init(NULL);
+  if (p.cols < 2 || p.rows < 2 || p.split < 1 || p.roundabouts < 0
+      || p.tlights < 0 || p.obstacles < 0)
+    log_fatal("[mapgen] invalid parameters\n");
+  if (p.steps < 2 || p.steps > MAX_ITI_COUNT)
+    log_fatal("[mapgen] itinerary steps should be in [2, %d]\n",
+              MAX_ITI_COUNT);
+  if (p.block / p.split < 2 * WAYP_BEFORE + 1 || p.block < 4 * RD_SIZE_HALF_WIDTH)
+    log_fatal("[mapgen] roads too short, increase -b or decrease -s\n");
+  if (2 * MARGIN + (p.cols - 1) * p.block >= MAX_X
+      || 2 * MARGIN + (p.rows - 1) * p.block >= MAX_Y)
+    log_fatal("[mapgen] the city does not fit in %dx%d cm\n", MAX_X, MAX_Y);
+
+  rng_state = p.seed;
+  city_build(&p);
+
+  int *route = calloc(road_sz, sizeof *route);
+  int *tl_roads = calloc(road_sz, sizeof *tl_roads);
+  int *obst_roads = calloc(road_sz, sizeof *obst_roads);
+  if (!route || !tl_roads || !obst_roads)
+    log_fatal("[mapgen] out of memory\n");
+
+  int route_sz, steps = route_build(&p, route, &route_sz);
+  int tl_sz = pick_roads(p.tlights, tlight_road, tl_roads);
+  int obst_sz = pick_roads(p.obstacles, obstacle_road, obst_roads);
+
+  /* Write the map, and its itinerary alone as in the assets directory. */
+  const char *out = argv[optind];
+  char filename[512], name[64];
+  const char *base = strrchr(out, '/') ? strrchr(out, '/') + 1 : out;
+  snprintf(name, sizeof name, "%s", base);
+
+  snprintf(filename, sizeof filename, "%s.map", out);
+  FILE *f = fopen(filename, "w");
+  if (!f)
+    log_fatal("[mapgen] could not open %s\n", filename);
+  map_write(f, name, route, route_sz, steps,
+            tl_roads, tl_sz, obst_roads, obst_sz);
+  fclose(f);
+
+  snprintf(filename, sizeof filename, "%s.iti", out);
+  f = fopen(filename, "w");
+  if (!f)
+    log_fatal("[mapgen] could not open %s\n", filename);
+  itinerary_write(f, route, route_sz);
+  fclose(f);
+
+  log_info("[mapgen] %s: %d roads, %d traffic lights, %d obstacles,"
+           " %d itinerary steps\n", out, road_sz, tl_sz, obst_sz, steps);
+
+  free(route);
+  free(tl_roads);
+  free(obst_roads);
+  free(roads);
+  log_shutdown();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,238 @@
+/* This file is part of SyncContest.
+   Copyright (C) 2017-2020 Eugene Asarin, Mihaela Sighireanu, Adrien Guatto. */
+
+#include "replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cutils.h"
+#include "trace.h"
+
+#define REPLAY_MAGIC "SCREPLY2"
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct {
+  char                 magic[8];       /* REPLAY_MAGIC */
+  uint64_t             map_hash;       /* FNV-1a hash of the map file */
+  Globals__phase       init_phase;     /* Initial phase at the start */
+  int32_t              top;            /* Has the race started at once? */
+  uint32_t             digest_period;  /* REPLAY_DIGEST_PERIOD */
+} replay_header_t;
+
+typedef enum {
+  REPLAY_TOP,                          /* The race starts */
+  REPLAY_HEAD,                         /* value is the new heading */
+  REPLAY_DIGEST,                       /* value digests the last outputs */
+  REPLAY_END                           /* Likewise, at the end of the race */
+} replay_kind_t;
+
+/* Records are stored in tick order, digests of a tick before its inputs. */
+typedef struct {
+  uint32_t             kind;           /* See replay_kind_t */
+  uint32_t             tick;           /* Steps performed before the record */
+  uint64_t             value;
+} replay_record_t;
+
+/** Fold the outputs of the last step into digest, FNV-1a */
+uint64_t replay_digest(uint64_t digest, const Challenge__the_challenge_out *o) {
+  unsigned char bytes[sizeof o->ph + sizeof o->scoreA];
+
+  memcpy(bytes, &o->ph, sizeof o->ph);
+  memcpy(bytes + sizeof o->ph, &o->scoreA, sizeof o->scoreA);
+  for (size_t i = 0; i < sizeof bytes; i++)
+    digest = (digest ^ bytes[i]) * FNV_PRIME;
+  return digest;
+}
+
+void recorder_write(recorder_t *rec, replay_kind_t kind,
+                    const race_state_t *state, uint64_t value) {
+  replay_record_t r = { kind, state->current_tick, value };
+  if (fwrite(&r, sizeof r, 1, rec->f) != 1)
+    log_fatal("[replay] could not write to %s\n", rec->filename);
+}
+
+void recorder_open(recorder_t *rec, const char *filename,
+                   const race_state_t *state) {
+  replay_header_t header;
+
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, REPLAY_MAGIC, sizeof header.magic);
+  header.map_hash = state->map->hash;
+  header.init_phase = state->init_phase;
+  header.top = state->top;
+  header.digest_period = REPLAY_DIGEST_PERIOD;
+
+  rec->filename = filename;
+  rec->digest = FNV_OFFSET;
+  if (!(rec->f = fopen(filename, "wb"))
+      || fwrite(&header, sizeof header, 1, rec->f) != 1)
+    log_fatal("[replay] could not write to %s\n", filename);
+  log_info("[replay] recording to %s\n", filename);
+}
+
+void recorder_top(recorder_t *rec, const race_state_t *state) {
+  recorder_write(rec, REPLAY_TOP, state, 0);
+}
+
+void recorder_head(recorder_t *rec, const race_state_t *state) {
+  uint32_t bits;
+  memcpy(&bits, &state->init_phase.ph_head, sizeof bits);
+  recorder_write(rec, REPLAY_HEAD, state, bits);
+}
+
+void recorder_step(recorder_t *rec, const race_state_t *state) {
+  rec->digest = replay_digest(rec->digest, &state->out);
+  if (state->current_tick % REPLAY_DIGEST_PERIOD == 0) {
+    recorder_write(rec, REPLAY_DIGEST, state, rec->digest);
+    rec->digest = FNV_OFFSET;
+  }
+}
+
+void recorder_close(recorder_t *rec, const race_state_t *state) {
+  recorder_write(rec, REPLAY_END, state, rec->digest);
+  if (fclose(rec->f))
+    log_fatal("[replay] could not write to %s\n", rec->filename);
+  rec->f = NULL;
+  log_info("[replay] recorded %zu ticks\n", state->current_tick);
+}
+
+/** Read the next record of f, which must exist */
+void replay_read(FILE *f, const char *filename, replay_record_t *r) {
+  if (fread(r, sizeof *r, 1, f) != 1)
+    log_fatal("[replay] truncated recording %s\n", filename);
+}
+
+bool replay_run(const char *filename) {
+  replay_header_t header;
+  replay_record_t r;
+  race_state_t state;
+  race_result_t res;
+  uint64_t digest = FNV_OFFSET;
+  bool same = true, over = false;
+  size_t last_tick = 0;
+
+  FILE *f = fopen(filename, "rb");
+  if (!f)
+    log_fatal("[replay] could not open %s\n", filename);
+  if (fread(&header, sizeof header, 1, f) != 1
+      || memcmp(header.magic, REPLAY_MAGIC, sizeof header.magic)
+      || header.digest_period != REPLAY_DIGEST_PERIOD)
+    log_fatal("[replay] %s is not a recording\n", filename);
+  if (header.map_hash != map->hash)
+    log_fatal("[replay] %s was recorded on another map than %s\n",
+              filename, map->name);
+
+  simulation_init(&state, header.top);
+  state.init_phase = header.init_phase;
+  replay_read(f, filename, &r);
+
+  while (same) {
+    /* Apply the inputs which were given after the last step. */
+    while (r.tick == state.current_tick
+           && (r.kind == REPLAY_TOP || r.kind == REPLAY_HEAD)) {
+      if (r.kind == REPLAY_TOP)
+        state.top = true;
+      else {
+        uint32_t bits = r.value;
+        memcpy(&state.init_phase.ph_head, &bits, sizeof bits);
+      }
+      replay_read(f, filename, &r);
+    }
+
+    if (r.kind == REPLAY_END && r.tick == state.current_tick) {
+      same = r.value == digest;
+      break;
+    }
+    if (r.tick <= state.current_tick || over)
+      log_fatal("[replay] inconsistent recording %s at tick %zu\n",
+                filename, state.current_tick);
+
+    over = simulation_step(&state, &res);
+    digest = replay_digest(digest, &state.out);
+
+    if (state.current_tick % REPLAY_DIGEST_PERIOD == 0) {
+      if (r.kind != REPLAY_DIGEST || r.tick != state.current_tick)
+        log_fatal("[replay] inconsistent recording %s at tick %zu\n",
+                  filename, state.current_tick);
+      same = r.value == digest;
+      if (same) {
+        last_tick = state.current_tick;
+        digest = FNV_OFFSET;
+        replay_read(f, filename, &r);
+      }
+    }
+  }
+  fclose(f);
+
+  if (same)
+    log_info("[replay] %zu ticks replayed identically, score = %d\n",
+             state.current_tick, state.out.scoreA);
+  else
+    log_info("[replay] outputs differ between ticks %zu and %zu\n",
+             last_tick, state.current_tick);
+  return same;
+}
+
+/** Run state until it ends or reaches max_synchronous_steps when not zero,
+    returning the digest of its outputs at each step */
+uint64_t replay_digest_run(race_state_t *state, size_t max_synchronous_steps,
+                           race_result_t *res) {
+  uint64_t digest = FNV_OFFSET;
+  bool over = false;
+
+  *res = RACE_TIMEOUT;
+  while (!over && (!max_synchronous_steps
+                   || state->current_tick < max_synchronous_steps)) {
+    over = simulation_step(state, res);
+    digest = replay_digest(digest, &state->out);
+  }
+  return digest;
+}
+
+bool replay_check_snapshot(size_t save_tick, size_t max_synchronous_steps) {
+  race_state_t state, snapshot;
+  race_result_t res, expected_res;
+  const size_t fork_count = 2;
+
+  simulation_init(&state, true);
+  if (save_tick > 0)
+    replay_digest_run(&state, save_tick, &res);
+  if (state.current_tick < save_tick) {
+    log_info("[replay] race over at tick %zu, before the snapshot\n",
+             state.current_tick);
+    return false;
+  }
+  simulation_save(&state, &snapshot);
+
+  /* The reference run, then the same from the snapshot. */
+  uint64_t expected = replay_digest_run(&state, max_synchronous_steps,
+                                        &expected_res);
+  size_t expected_tick = state.current_tick;
+
+  /* Only the reference run is traced, the others would interleave their
+     steps with it in the trace. */
+  hept_trace_suspend(true);
+  simulation_restore(&state, &snapshot);
+  uint64_t digest = replay_digest_run(&state, max_synchronous_steps, &res);
+  bool same = digest == expected && res == expected_res
+    && state.current_tick == expected_tick;
+
+  race_state_t *forks = simulation_fork(&snapshot, fork_count);
+  for (size_t i = 0; i < fork_count; i++) {
+    digest = replay_digest_run(&forks[i], max_synchronous_steps, &res);
+    same = same && digest == expected && res == expected_res
+      && forks[i].current_tick == expected_tick;
+  }
+  free(forks);
+  hept_trace_suspend(false);
+
+  if (same)
+    log_info("[replay] restored and forked snapshot of tick %zu resumed "
+             "identically until tick %zu\n", save_tick, expected_tick);
+  else
+    log_info("[replay] runs from the snapshot of tick %zu differ\n",
+             save_tick);
+  return same;
+}
@@ -0,0 +1,49 @@
+/* This file is part of SyncContest.
+   Copyright (C) 2017-2020 Eugene Asarin, Mihaela Sighireanu, Adrien Guatto. */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "simulation_loop.h"
+
+/* Recordings of the inputs of a race, that is the start signal and the
+   edits of the initial heading, with the ticks at which they happened. A
+   recording also holds digests of the outputs (phase and score) every
+   REPLAY_DIGEST_PERIOD ticks, so that replaying it checks that the race
+   behaves bit for bit as when it was recorded. It is tied to the map file
+   it was recorded on by the hash of its contents. */
+
+#define REPLAY_DIGEST_PERIOD 64
+
+typedef struct {
+  FILE                 *f;
+  const char           *filename;
+  uint64_t             digest;         /* Outputs since the last record */
+} recorder_t;
+
+/* Start recording the race which starts from state into filename. */
+void recorder_open(recorder_t *rec, const char *filename,
+                   const race_state_t *state);
+/* Record the inputs of state, which have just been changed. */
+void recorder_top(recorder_t *rec, const race_state_t *state);
+void recorder_head(recorder_t *rec, const race_state_t *state);
+/* Record the outputs of the step which has just been performed. */
+void recorder_step(recorder_t *rec, const race_state_t *state);
+void recorder_close(recorder_t *rec, const race_state_t *state);
+
+/* Replay the recording in filename on the current map, unthrottled, and
+   return true when its outputs match the recorded ones. */
+bool replay_run(const char *filename);
+
+/* Race on the current map until save_tick, take a snapshot, and go on until
+   the race ends or reaches max_synchronous_steps when not zero. Then do so
+   again from the snapshot, restored in place and in forks, and return true
+   when all of them have the same outputs at every step, bit for bit as far
+   as the digests of recordings tell. */
+bool replay_check_snapshot(size_t save_tick, size_t max_synchronous_steps);
+
+#endif  /* REPLAY_H */
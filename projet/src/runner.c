@@ -0,0 +1,98 @@
+/* This file is part of SyncContest.
+   Copyright (C) 2017-2020 Eugene Asarin, Mihaela Sighireanu, Adrien Guatto. */
+
+#include "runner.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+#include "trace.h"
+
+typedef struct {
+  race_job_t              *jobs;
+  size_t                  job_count;
+  atomic_size_t           next;         /* Next job to start */
+  const runner_options_t  *options;
+} runner_t;
+
+/** Run job i, on the current thread. Fatal errors exit the process, see
+    runner_run(). */
+void runner_run_job(const runner_options_t *options, race_job_t *job,
+                    size_t i) {
+  char filename[512];
+
+  log_set_verbosity_level(options->log_level);
+  if (options->log_filename)
+    snprintf(filename, sizeof filename, "%s.%zu", options->log_filename, i);
+  log_init(options->log_filename ? filename : NULL);
+
+  /* Keep the extension, which selects the trace format. */
+  const char *trace_env = getenv(HEPT_TRACE_ENV_VAR);
+  if (trace_env) {
+    const char *ext = strrchr(trace_env, '.');
+    if (ext && strchr(ext, '/'))
+      ext = NULL;
+    int len = ext ? ext - trace_env : (int)strlen(trace_env);
+    snprintf(filename, sizeof filename, "%.*s.%zu%s",
+             len, trace_env, i, ext ? ext : "");
+    hept_trace_open(filename);
+  }
+
+  map_load(job->map_filename);
+  if (options->raster_res > 0.f)
+    map_raster_load(job->map_filename, options->raster_res);
+  map->init_phase.ph_pos.x += job->init_offset.ph_pos.x;
+  map->init_phase.ph_pos.y += job->init_offset.ph_pos.y;
+  map->init_phase.ph_head += job->init_offset.ph_head;
+
+  Challenge__the_challenge_out out;
+  job->result = simulation_batch(true, options->max_synchronous_steps,
+                                 &out, &job->ticks);
+  if (job->result == RACE_CRASH)
+    hept_trace_dump();
+  job->scoreA = out.scoreA;
+  job->scoreB = out.scoreB;
+  job->time = out.time;
+
+  map_destroy();
+  hept_trace_quit();
+  log_shutdown();
+}
+
+void *runner_worker(void *arg) {
+  runner_t *rn = arg;
+  size_t i;
+
+  while ((i = atomic_fetch_add(&rn->next, 1)) < rn->job_count)
+    runner_run_job(rn->options, &rn->jobs[i], i);
+  return NULL;
+}
+
+void runner_run(race_job_t *jobs, size_t job_count,
+                const runner_options_t *options) {
+  runner_t rn = { jobs, job_count, 0, options };
+  size_t thread_count = options->threads;
+
+  if (thread_count > job_count)
+    thread_count = job_count;
+  if (thread_count == 0)
+    return;
+
+  pthread_t *threads = calloc(thread_count, sizeof *threads);
+  if (!threads)
+    log_fatal("[runner] could not allocate threads\n");
+
+  log_info("[runner] running %zu races on %zu threads\n",
+           job_count, thread_count);
+  for (size_t t = 0; t < thread_count; t++)
+    if (pthread_create(&threads[t], NULL, runner_worker, &rn))
+      log_fatal("[runner] could not create thread\n");
+  for (size_t t = 0; t < thread_count; t++)
+    pthread_join(threads[t], NULL);
+
+  free(threads);
+}
@@ -0,0 +1,43 @@
+/* This file is part of SyncContest.
+   Copyright (C) 2017-2020 Eugene Asarin, Mihaela Sighireanu, Adrien Guatto. */
+
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include <stddef.h>
+
+#include "cutils.h"
+#include "simulation_loop.h"
+
+/* The runner plays independent races on a pool of threads. Each thread runs
+   one race at a time, with its own map, log and trace, see the thread-local
+   state of map.c, cutils.c and trace.c. */
+
+typedef struct {
+  const char           *map_filename;   /* Map of the race */
+  Globals__phase       init_offset;     /* Added to the initial phase */
+  race_result_t        result;          /* Outcome of the race */
+  int                  scoreA, scoreB;  /* Final scores */
+  float                time;            /* Race time (in s) */
+  size_t               ticks;           /* Synchronous steps performed */
+} race_job_t;
+
+typedef struct {
+  size_t               threads;         /* Worker threads */
+  size_t               max_synchronous_steps; /* 0 for no limit */
+  float                raster_res;      /* Raster cell size, 0 for none */
+  log_verbosity_level  log_level;       /* Verbosity of the races */
+  const char           *log_filename;   /* Race i logs to <log_filename>.i */
+} runner_options_t;
+
+/* Run all the races, which start immediately, and fill their results.
+
+   Errors which are fatal to a single race, such as a map, raster or trace
+   which cannot be loaded or opened, go through log_fatal() and exit the
+   process: the first bad job aborts the whole batch, and no result is
+   reported for the races which were still running. The message names the
+   faulty file, check the inputs of a long batch with a single race first. */
+void runner_run(race_job_t *jobs, size_t job_count,
+                const runner_options_t *options);
+
+#endif  /* RUNNER_H */
@@ -3,12 +3,21 @@
 
 #include "simulation_loop.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <SDL.h>
 
 #include "mymath.h"
 #include "challenge.h"
 #include "cutils.h"
 #include "map.h"
+#include "replay.h"
+#include "trace.h"
 
 #ifndef ASSET_DIR_PATH
 #define ASSET_DIR_PATH "./assets"
@@ -80,12 +89,6 @@ void sdl_point_of_position(Globals__position *position, SDL_Point *point) {
   sdl_space_of_position(position, &point->x, &point->y);
 }
 
-int draw_point(SDL_Renderer *rd, Globals__position *p) {
-  int x, y;
-  sdl_space_of_position(p, &x, &y);
-  return SDL_RenderDrawPoint(rd, x, y);
-}
-
 int draw_line(SDL_Renderer *rd,
               Globals__position *startp, Globals__position *endp) {
   int x1, y1, x2, y2;
@@ -94,292 +97,758 @@ int draw_line(SDL_Renderer *rd,
   return SDL_RenderDrawLine(rd, x1, y1, x2, y2);
 }
 
-void draw_rectangle(SDL_Renderer *rd, Globals__position *center, size_t l,
-                    uint32_t r, uint32_t g, uint32_t b) {
-  SDL_Rect rect = (SDL_Rect){ 0, 0, l, l };
-  /* Compute coordinates. */
-  sdl_space_of_position(center, &rect.x, &rect.y);
-  rect.x -= l / 2;
-  rect.y -= l / 2;
-  /* Render rectangle. */
-  SDL_SetRenderDrawColor(rd, r, g, b, 0x00);
-  if (SDL_RenderFillRect(rd, &rect) < 0)
-    log_fatal("[sdl] could not draw rectangle (%s)\n", SDL_GetError());
-  SDL_SetRenderDrawColor(rd, 0xFF, 0xFF, 0xFF, 0);
-  if (draw_point(rd, center) < 0)
-    log_fatal("[sdl] could not draw point (%s)\n", SDL_GetError());
-}
-
-void draw_tile(SDL_Renderer *rd,
-               SDL_Texture *texture,
-               Globals__position *p,
-               double angle,
-               int w,
-               int h) {
-  SDL_Rect dst_rect = { 0, 0, w, h };
-  Globals__position center = { p->x - w / 2, p->y + h / 2 };
-  sdl_space_of_position(&center, &dst_rect.x, &dst_rect.y);
-
-  SDL_RenderCopyEx(rd,             /* renderer */
-                   texture,        /* texture */
-                   NULL,           /* entire texture */
-                   &dst_rect,      /* destination */
-                   angle,          /* angle (cw) */
-                   NULL,           /* center dst_rec */
-                   SDL_FLIP_NONE); /* no flipping */
+/* Sprite atlas: the car and obstacle sprites side by side in one texture,
+   so that a single draw call renders all of them. */
+typedef struct {
+  SDL_Texture          *texture;
+  int                  w, h;           /* Size of the atlas */
+  SDL_Rect             car;            /* Car sprite within the atlas */
+  SDL_Rect             obs;            /* Obstacle sprite within the atlas */
+} atlas_t;
+
+void load_asset_atlas(SDL_Renderer *r, atlas_t *atlas) {
+  SDL_Surface *car = load_asset_bmp_surface("orange.bmp");
+  SDL_Surface *obs = load_asset_bmp_surface("obst.bmp");
+
+  atlas->car = (SDL_Rect){ 0, 0, car->w, car->h };
+  atlas->obs = (SDL_Rect){ car->w, 0, obs->w, obs->h };
+  atlas->w = car->w + obs->w;
+  atlas->h = car->h > obs->h ? car->h : obs->h;
+
+  SDL_Surface *s = SDL_CreateRGBSurfaceWithFormat(0, atlas->w, atlas->h, 32,
+                                                  SDL_PIXELFORMAT_RGBA32);
+  if (!s
+      || SDL_BlitSurface(car, NULL, s, &atlas->car) < 0
+      || SDL_BlitSurface(obs, NULL, s, &atlas->obs) < 0)
+    log_fatal("[sdl] could not build sprite atlas (%s)\n", SDL_GetError());
+  SDL_FreeSurface(car);
+  SDL_FreeSurface(obs);
+
+  atlas->texture = SDL_CreateTextureFromSurface(r, s);
+  if (!atlas->texture)
+    log_fatal("[sdl] could not load sprite atlas (%s)\n", SDL_GetError());
+  SDL_FreeSurface(s);
+
+  log_info("[sdl] loaded sprite atlas (%dx%d)\n", atlas->w, atlas->h);
 }
 
-race_result_t simulation_loop(bool show_guide,
-                              int initial_top,
-                              float sps,
-                              bool headless,
-                              bool audio,
-                              size_t max_synchronous_steps) {
-  SDL_Window *w;
-  bool quit = false;                /* Shall we quit? */
-  race_result_t res = RACE_TIMEOUT; /* Did we complete the race? */
-  int top = initial_top;            /* Has the race started? */
-  bool verbose = false, debug = false;
-  int car_w, car_h, obs_w, obs_h;
-  SDL_Texture *bg, *car, *obs;
-  SDL_Renderer *r;
-  size_t current_tick = 0;
+/* Quads of a frame, gathered in vertex arrays so that each batch takes a
+   single SDL_RenderGeometry call. */
+#define BATCH_MAX_QUADS (1 + MAX_OBST_COUNT + 2 * MAX_TL_COUNT + 2)
+
+typedef struct {
+  SDL_Vertex           verts[4 * BATCH_MAX_QUADS];
+  int                  indices[6 * BATCH_MAX_QUADS];
+  int                  quads;
+} quad_batch_t;
+
+/** Add a w x h quad centered on p, rotated by angle degrees clockwise on
+    screen, with sprite src of atlas or plain color c when src is NULL */
+void batch_quad(quad_batch_t *b, Globals__position *p, float w, float h,
+                float angle, SDL_Color c,
+                const atlas_t *atlas, const SDL_Rect *src) {
+  const float cx[4] = { -.5f, .5f, .5f, -.5f };
+  const float cy[4] = { -.5f, -.5f, .5f, .5f };
+  float ca = cos(angle / 180. * M_PI), sa = sin(angle / 180. * M_PI);
+  SDL_Vertex *v = &b->verts[4 * b->quads];
+  int *idx = &b->indices[6 * b->quads];
+
+  assert (b->quads < BATCH_MAX_QUADS);
+  for (int i = 0; i < 4; i++) {
+    float dx = cx[i] * w, dy = cy[i] * h;
+    v[i].position.x = p->x + dx * ca - dy * sa;
+    v[i].position.y = MAX_Y - p->y + dx * sa + dy * ca;
+    v[i].color = c;
+    if (src) {
+      v[i].tex_coord.x = (src->x + (cx[i] + .5f) * src->w) / atlas->w;
+      v[i].tex_coord.y = (src->y + (cy[i] + .5f) * src->h) / atlas->h;
+    } else
+      v[i].tex_coord = (SDL_FPoint){ 0.f, 0.f };
+  }
 
-  /* Initialize SDL and acquire resources. */
+  const int tri[6] = { 0, 1, 2, 0, 2, 3 };
+  for (int i = 0; i < 6; i++)
+    idx[i] = 4 * b->quads + tri[i];
+  b->quads++;
+}
+
+/** Add a square of side l centered on p, with a white dot at its center */
+void batch_square(quad_batch_t *b, Globals__position *p, float l,
+                  uint8_t r, uint8_t g, uint8_t bl) {
+  batch_quad(b, p, l, l, 0.f, (SDL_Color){ r, g, bl, 0xFF }, NULL, NULL);
+  batch_quad(b, p, 1.f, 1.f, 0.f, (SDL_Color){ 0xFF, 0xFF, 0xFF, 0xFF },
+             NULL, NULL);
+}
+
+/** Draw and empty batch b, with texture t or plain colors when NULL */
+void batch_flush(SDL_Renderer *rd, quad_batch_t *b, SDL_Texture *t) {
+  if (b->quads
+      && SDL_RenderGeometry(rd, t, b->verts, 4 * b->quads,
+                            b->indices, 6 * b->quads) < 0)
+    log_fatal("[sdl] could not draw geometry (%s)\n", SDL_GetError());
+  b->quads = 0;
+}
+
+/* Debug overlay: the static map geometry is drawn once into a transparent
+   texture, which is then copied over the background of each debug frame. */
+
+#define ARC_MAX_ERROR 0.25      /* Maximal distance from chords to arcs */
+#define ARC_MAX_CHORDS 512
 
-  if (!headless) {
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
-      log_fatal("[sdl] could not initialize SDL library (%s)\n",
+/** Draw road rd, tessellating arcs into chords */
+void draw_road(SDL_Renderer *rd, road_t *road) {
+  SDL_Point points[ARC_MAX_CHORDS + 1];
+
+  if (road->kind != RD_ARC) {
+    draw_line(rd, &road->u.line.startp, &road->u.line.endp);
+    return;
+  }
+
+  /* Chords of angle a stay within r (1 - cos(a / 2)) of the arc. */
+  double r = road->u.arc.radius;
+  double span = road->geo.arc_span * M_PI / 180.;
+  double max_angle = r > ARC_MAX_ERROR
+    ? 2. * acos(1. - ARC_MAX_ERROR / r) : M_PI / 2.;
+  int n = ceil(span / max_angle);
+  n = n < 1 ? 1 : n > ARC_MAX_CHORDS ? ARC_MAX_CHORDS : n;
+
+  double first = atan2(road->geo.arc_first_y, road->geo.arc_first_x);
+  for (int i = 0; i <= n; i++) {
+    Globals__position p;
+    p.x = road->u.arc.center.x + r * cos(first + span * i / n);
+    p.y = road->u.arc.center.y + r * sin(first + span * i / n);
+    sdl_point_of_position(&p, &points[i]);
+  }
+  SDL_RenderDrawLines(rd, points, n + 1);
+}
+
+/** Draw squares of side l centered on the positions of n elements of size
+    elt_sz, found at offset pos_off within each one, in one batch */
+void draw_rectangles(SDL_Renderer *rd, const void *elts, size_t elt_sz,
+                     size_t pos_off, size_t n,
+                     int l, uint32_t r, uint32_t g, uint32_t b) {
+  SDL_Rect *rects = calloc(n ? n : 1, sizeof *rects);
+  SDL_Point *centers = calloc(n ? n : 1, sizeof *centers);
+  if (!rects || !centers)
+    log_fatal("[sdl] could not allocate %zu rectangles\n", n);
+
+  for (size_t i = 0; i < n; i++) {
+    Globals__position *p =
+      (Globals__position *)((const char *)elts + i * elt_sz + pos_off);
+    sdl_point_of_position(p, &centers[i]);
+    rects[i] = (SDL_Rect){ centers[i].x - l / 2, centers[i].y - l / 2, l, l };
+  }
+
+  SDL_SetRenderDrawColor(rd, r, g, b, 0xFF);
+  if (SDL_RenderFillRects(rd, rects, n) < 0)
+    log_fatal("[sdl] could not draw rectangles (%s)\n", SDL_GetError());
+  SDL_SetRenderDrawColor(rd, 0xFF, 0xFF, 0xFF, 0xFF);
+  if (SDL_RenderDrawPoints(rd, centers, n) < 0)
+    log_fatal("[sdl] could not draw points (%s)\n", SDL_GetError());
+
+  free(centers);
+  free(rects);
+}
+
+/** Draw the static map geometry into overlay, creating it when NULL */
+SDL_Texture *render_map_overlay(SDL_Renderer *rd, SDL_Texture *overlay) {
+  if (!overlay) {
+    overlay = SDL_CreateTexture(rd, SDL_PIXELFORMAT_RGBA8888,
+                                SDL_TEXTUREACCESS_TARGET, MAX_X, MAX_Y);
+    if (!overlay)
+      log_fatal("[sdl] could not create overlay texture (%s)\n",
                 SDL_GetError());
+    SDL_SetTextureBlendMode(overlay, SDL_BLENDMODE_BLEND);
+  }
+
+  if (SDL_SetRenderTarget(rd, overlay) < 0)
+    log_fatal("[sdl] could not render to overlay (%s)\n", SDL_GetError());
+  SDL_SetRenderDrawColor(rd, 0x00, 0x00, 0x00, 0x00);
+  SDL_RenderClear(rd);
+
+  SDL_SetRenderDrawColor(rd, 0x00, 0x00, 0xFF, 0xFF);
+  for (size_t i = 0; i < map->road_sz; i++)
+    draw_road(rd, &map->road_arr[i]);
+
+  /* Waypoints, traffic lights, stops and obstacles. */
+  draw_rectangles(rd, map->wayp_arr, sizeof *map->wayp_arr,
+                  offsetof(waypoint_t, position), map->wayp_sz,
+                  10, 0xFF, 0x00, 0x00);
+  draw_rectangles(rd, map->tlight_arr, sizeof *map->tlight_arr,
+                  offsetof(tlight_t, tl.ptl_pos), map->tlight_sz,
+                  10, 0x00, 0x00, 0xFF);
+  draw_rectangles(rd, map->stop_arr, sizeof *map->stop_arr,
+                  offsetof(stop_t, position), map->stop_sz,
+                  10, 0x84, 0x21, 0xFF);
+  draw_rectangles(rd, map->obst_arr, sizeof *map->obst_arr,
+                  offsetof(obst_t, pot_pos), map->obst_sz,
+                  10, 0x12, 0xAE, 0x00);
+
+  SDL_SetRenderTarget(rd, NULL);
+  log_info("[sdl] rendered map overlay\n");
+  return overlay;
+}
+
+/** Monotonic time in nanoseconds */
+uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Sleep until the monotonic time reaches t, in nanoseconds */
+void sleep_until_ns(uint64_t t) {
+  struct timespec ts = { t / 1000000000ULL, t % 1000000000ULL };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/* The status line shows the car and score on the terminal, refreshed at
+   most every STATUS_PERIOD_NS, and only when stdout is a terminal. It goes
+   through the log module, which erases it before each log message. */
+#define STATUS_PERIOD_NS 100000000ULL
+
+typedef struct {
+  bool                 enabled;
+  uint64_t             next_ns;        /* Time of the next refresh */
+} status_t;
+
+void status_init(status_t *status) {
+  status->enabled = isatty(STDOUT_FILENO);
+  status->next_ns = 0;
+}
+
+void status_update(status_t *status, const race_state_t *st, uint64_t now_ns) {
+  if (!status->enabled || now_ns < status->next_ns)
+    return;
+  log_status("H %06.2f\tV %06.2f\tT %06.2f\tS %09d",
+             st->out.ph.ph_head, st->out.ph.ph_vel, st->out.time,
+             st->out.scoreA);
+  status->next_ns = now_ns + STATUS_PERIOD_NS;
+}
+
+/** Erase the status line */
+void status_clear(status_t *status) {
+  if (status->enabled)
+    log_status_clear();
+}
+
+/** Log a summary of the race, one key=value field per item */
+void status_summary(const race_state_t *st, race_result_t res) {
+  const char *results[] = { "success", "crash", "timeout" };
+  const Challenge__the_challenge_out *o = &st->out;
+
+  log_info("[simulation] summary: result=%s ticks=%zu time=%.2f "
+           "scoreA=%d scoreB=%d x=%.2f y=%.2f head=%.2f vel=%.2f\n",
+           results[res], st->current_tick, o->time, o->scoreA, o->scoreB,
+           o->ph.ph_pos.x, o->ph.ph_pos.y, o->ph.ph_head, o->ph.ph_vel);
+}
+
+void simulation_init(race_state_t *state, int top) {
+  Challenge__the_challenge_reset(&state->mem);
+  memset(&state->out, 0, sizeof state->out);
+  state->init_phase = map->init_phase;
+  state->top = top;
+  state->current_tick = 0;
+  state->time_budget_ns = 1e9 * Globals__timestep + .5; /* One step. */
+  state->map = map;
+}
+
+bool simulation_step(race_state_t *state, race_result_t *res) {
+  Challenge__the_challenge_out *out = &state->out;
+
+  assert (state->map == map);
+  Challenge__the_challenge_step(state->init_phase, state->top,
+                                out, &state->mem);
+  state->current_tick++;
+  hept_trace_cycle();
+
+  /* Check robot status once simulation has started. */
+  if (!state->top)
+    return false;
+  switch (out->sta) {
+  case Globals__Preparing:
+  case Globals__Running:
+    break;
+  case Globals__Arrived:
+    log_info("[simulation %08zu] race finished\n", state->current_tick);
+    *res = RACE_SUCCESS;
+    return true;
+  case Globals__Stopped:
+    log_info("[simulation %08zu] car stopped\n", state->current_tick);
+    *res = RACE_CRASH;
+    return true;
+  }
+  return false;
+}
+
+race_result_t simulation_run(race_state_t *state,
+                             size_t max_synchronous_steps) {
+  race_result_t res = RACE_TIMEOUT;
+
+  while ((!max_synchronous_steps
+          || state->current_tick < max_synchronous_steps)
+         && !simulation_step(state, &res))
+    ;
+  return res;
+}
+
+race_result_t simulation_batch(int top,
+                               size_t max_synchronous_steps,
+                               Challenge__the_challenge_out *out,
+                               size_t *current_tick) {
+  race_state_t state;
+  race_result_t res;
+
+  simulation_init(&state, top);
+  res = simulation_run(&state, max_synchronous_steps);
+  *out = state.out;
+  *current_tick = state.current_tick;
+  return res;
+}
+
+void simulation_save(const race_state_t *state, race_state_t *snapshot) {
+  *snapshot = *state;
+}
+
+void simulation_restore(race_state_t *state, const race_state_t *snapshot) {
+  *state = *snapshot;
+  map = snapshot->map;
+}
+
+race_state_t *simulation_fork(const race_state_t *snapshot, size_t k) {
+  race_state_t *forks = calloc(k, sizeof *forks);
+  if (!forks)
+    log_fatal("[simulation] could not allocate %zu forks\n", k);
+  for (size_t i = 0; i < k; i++)
+    forks[i] = *snapshot;
+  return forks;
+}
+
+/* A frame is what the renderer needs to know about one synchronous step. */
+typedef struct {
+  Globals__phase       ph;             /* Phase of the car */
+  Globals__sign        sign;           /* Signalization in view */
+  Globals__status      sta;            /* Status of the car */
+  Globals__phase       init_phase;     /* Initial phase, before the start */
+  int                  top;            /* Has the race started? */
+  size_t               tick;           /* Synchronous steps so far */
+} frame_t;
+
+/* Frames go from the simulation to the renderer through a triple buffer.
+   The simulation fills the back frame then swaps it with the middle one,
+   and the renderer swaps the front frame with the middle one when the
+   latter is fresh. Neither side ever waits for the other. */
+#define FRAME_FRESH 4u
+
+typedef struct {
+  frame_t              frames[3];
+  unsigned             back;           /* Owned by the simulation */
+  unsigned             front;          /* Owned by the renderer */
+  atomic_uint          middle;         /* Index, FRAME_FRESH if unread */
+} frame_buffer_t;
+
+void frame_buffer_init(frame_buffer_t *b) {
+  memset(b->frames, 0, sizeof b->frames);
+  b->back = 0;
+  b->front = 1;
+  atomic_init(&b->middle, 2);
+}
+
+void frame_publish(frame_buffer_t *b, const race_state_t *st) {
+  frame_t *f = &b->frames[b->back];
+
+  f->ph = st->out.ph;
+  f->sign = st->out.sign;
+  f->sta = st->out.sta;
+  f->init_phase = st->init_phase;
+  f->top = st->top;
+  f->tick = st->current_tick;
+  b->back = atomic_exchange_explicit(&b->middle, b->back | FRAME_FRESH,
+                                     memory_order_acq_rel) & ~FRAME_FRESH;
+}
 
-    if ((w = SDL_CreateWindow("Synchronous Contest " YEAR " v" VERSION,
-                              SDL_WINDOWPOS_UNDEFINED,
-                              SDL_WINDOWPOS_UNDEFINED,
-                              MAX_X,
-                              MAX_Y,
-                              SDL_WINDOW_SHOWN)) == NULL)
-      log_fatal("[sdl] could not open window (%s)\n", SDL_GetError());
-
-    r = SDL_CreateRenderer(w, -1, SDL_RENDERER_ACCELERATED);
-    if (!r)
-      log_fatal("[sdl] could not create renderer (%s)\n", SDL_GetError());
-
-    if (!r)
-      log_fatal("[sdl] could not create renderer (%s)\n", SDL_GetError());
-
-    bg = load_asset_bmp_texture(show_guide ? map->guide : map->graphics,
-                                r,
-                                NULL,
-                                NULL);
-    car = load_asset_bmp_texture("orange.bmp",
-                                 r,
-                                 &car_w,
-                                 &car_h);
-    obs = load_asset_bmp_texture("obst.bmp",
-                                 r,
-                                 &obs_w,
-                                 &obs_h);
-
-    /* Load sounds and setup audio device. */
-
-    load_asset_wav("collision.wav", &collision);
-    load_asset_wav("direction.wav", &wrong_dir);
-    load_asset_wav("exit.wav", &exit_road);
-    load_asset_wav("light.wav", &light_run);
-    load_asset_wav("speed.wav", &speed_excess);
-
-    if (audio) {
-      if (!(audio_device =
-            SDL_OpenAudioDevice(NULL, 0, &collision.spec, NULL, 0))) {
-        log_info("[sdl] could not open audio device\n");
-      } else
-        SDL_PauseAudioDevice(audio_device, 0);
+/** Make the latest frame the front one, false if it was already */
+bool frame_acquire(frame_buffer_t *b) {
+  if (!(atomic_load_explicit(&b->middle, memory_order_relaxed) & FRAME_FRESH))
+    return false;
+  b->front = atomic_exchange_explicit(&b->middle, b->front,
+                                      memory_order_acq_rel) & ~FRAME_FRESH;
+  return true;
+}
+
+/* The renderer runs on the main thread, which owns SDL video, audio and
+   events, as SDL requires on some platforms. The simulation steps on its own
+   thread, and gets the user inputs through the atomic fields below. */
+typedef struct {
+  frame_buffer_t       frames;
+  bool                 show_guide;
+  bool                 audio;
+  atomic_bool          done;           /* The simulation is over */
+  atomic_bool          quit;           /* The user asked to quit */
+  atomic_bool          top;            /* The user asked to start */
+  atomic_bool          debug;          /* Debug display */
+  atomic_bool          verbose;        /* Verbose logs */
+  atomic_int           head_steps;     /* Heading edits, in 2 degree steps */
+  atomic_bool          dump;           /* The user asked for a trace dump */
+} renderer_t;
+
+/* What the simulation thread needs: the parameters of the race, and the
+   thread-local state of the thread which started it, that is its map, log
+   and trace. The trace comes back with the result. */
+typedef struct {
+  renderer_t           *rd;            /* NULL when headless */
+  map_t                *map;
+  log_context_t        log;
+  hept_trace_context_t trace;
+  int                  initial_top;
+  float                sps;
+  bool                 unthrottled;
+  size_t               max_synchronous_steps;
+  size_t               max_catch_up;
+  const char           *record_filename;
+  race_result_t        res;
+} race_loop_t;
+
+void render_frame(SDL_Renderer *r, frame_t *fr, bool debug,
+                  SDL_Texture *bg, SDL_Texture *overlay, const atlas_t *atlas) {
+  const SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+  quad_batch_t sprites, squares;
+  sprites.quads = squares.quads = 0;
+
+  /* Render the scene, which includes the background as well as the car. */
+  SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0xFF);
+
+  SDL_RenderClear(r);
+  SDL_RenderCopy(r, bg, NULL, NULL);
+
+  if (!debug)
+    batch_quad(&sprites, &fr->ph.ph_pos, atlas->car.w, atlas->car.h,
+               360.f - fr->ph.ph_head, white, atlas, &atlas->car);
+  else {
+    /* In debug mode, render the car as a plain square. */
+    Globals__phase ph; Globals__position endp; float f = 20.0;
+    if (fr->top) {
+      ph = fr->ph;
+      f *= ph.ph_vel / SPEED_MAX;
+    } else
+      ph = fr->init_phase;
+    batch_square(&squares, &ph.ph_pos, 5, 0x00, 0x00, 0x00);
+    endp.x = ph.ph_pos.x + f * cos(ph.ph_head / 360. * 2. * M_PI);
+    endp.y = ph.ph_pos.y + f * sin(ph.ph_head / 360. * 2. * M_PI);
+    /* The heading goes over the square, so the square is drawn first. */
+    batch_flush(r, &squares, NULL);
+    SDL_SetRenderDrawColor(r, 0x00, 0x00, 0x00, 0x00);
+    draw_line(r, &ph.ph_pos, &endp);
+    SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0);
+  }
+
+  /* We draw the signalization info, when relevant. */
+  if (!debug) {
+    for (size_t i = 0; i < MAX_OBST_COUNT; i++) {
+      Globals__obstacle *o = &fr->sign.si_obstacles[i];
+      if (o->o_pres)
+        batch_quad(&sprites, &o->o_pos, atlas->obs.w, atlas->obs.h, 0.f,
+                   white, atlas, &atlas->obs);
+    }
+
+    for (size_t i = 0; i < MAX_TL_COUNT; i++) {
+      Utilities__encode_color_out enc;
+      Globals__traflight *t = &fr->sign.si_tlights[i];
+      Utilities__encode_color_step(t->tl_color, &enc);
+      batch_square(&squares, &t->tl_pos, 10,
+                   enc.a.red, enc.a.green, enc.a.blue);
     }
   }
 
+  batch_flush(r, &sprites, atlas->texture);
+  batch_flush(r, &squares, NULL);
+
+  /* In debug mode, we also render the raw information coming from the
+     map. This is useful to understand the map file contents. */
+  if (debug)
+    SDL_RenderCopy(r, overlay, NULL, NULL);
+
+  SDL_RenderPresent(r);
+}
+
+/** Step the race of lp, paced to real time unless unthrottled */
+race_result_t simulation_pace(race_loop_t *lp) {
+  bool quit = false;                /* Shall we quit? */
+  race_result_t res = RACE_TIMEOUT; /* Did we complete the race? */
+  bool verbose = false, debug = false;
+  renderer_t *rd = lp->rd;
+  const char *record_filename = lp->record_filename;
+  size_t max_synchronous_steps = lp->max_synchronous_steps;
+  size_t max_catch_up = lp->max_catch_up;
+
   /* Initialize synchronous state. */
 
-  Challenge__the_challenge_out out;
-  Challenge__the_challenge_mem mem;
-  Challenge__the_challenge_reset(&mem);
+  race_state_t st;
+  simulation_init(&st, lp->initial_top);
 
-  /* Setup time counters. */
+  /* Record the inputs and outputs of the race, when asked to. */
+  recorder_t rec;
+  if (record_filename)
+    recorder_open(&rec, record_filename, &st);
 
-  const uint32_t sync_dt_ms = 1000.f * Globals__timestep;
-  const uint32_t simulation_dt_ms = (1. / (double)sps) * 1000.;
-  uint32_t time_budget_ms = sync_dt_ms; /* Enough to do one initial step. */
+  /* Setup time counters. */
 
-  log_info("[simulation] starting (%zu ms/cycle)\n", simulation_dt_ms);
+  const uint64_t sync_dt_ns = 1e9 * Globals__timestep + .5;
+  const uint64_t frame_dt_ns = 1e9 / lp->sps + .5;
+  uint64_t frame_start_ns = monotonic_ns();
+  size_t late_frames = 0, dropped_steps = 0;
+  status_t status;
+  status_init(&status);
+
+  /* In batch mode, step back to back without pacing nor status line. */
+  if (lp->unthrottled) {
+    log_info("[simulation] starting (unthrottled)\n");
+    while (!quit && (!max_synchronous_steps
+                     || st.current_tick < max_synchronous_steps)) {
+      quit = simulation_step(&st, &res);
+      if (record_filename)
+        recorder_step(&rec, &st);
+    }
+    quit = true;
+  } else
+    log_info("[simulation] starting (%.3f ms/cycle, %zu catch-up steps)\n",
+             frame_dt_ns / 1e6, max_catch_up);
 
   while (!quit
-         && (!max_synchronous_steps || current_tick < max_synchronous_steps)) {
-    SDL_Event e;
-    uint32_t start_time_ms = SDL_GetTicks();
-
-    /* Perform as many synchronous steps as possible within our budget. */
-    while (time_budget_ms >= sync_dt_ms
-           && (!max_synchronous_steps
-               || current_tick < max_synchronous_steps)) {
-      time_budget_ms -= sync_dt_ms;
-      Challenge__the_challenge_step(map->init_phase, top, &out, &mem);
-      current_tick++;
-      /* Check robot status once simulation has started. */
-      if (top) {
-        switch (out.sta) {
-        case Globals__Preparing:
-        case Globals__Running:
-          break;
-        case Globals__Arrived:
-          log_info("[simulation %08zu] race finished\n", current_tick);
-          res = RACE_SUCCESS;
-          quit = true;
-          break;
-        case Globals__Stopped:
-          log_info("[simulation %08zu] car stopped\n", current_tick);
-          res = RACE_CRASH;
-          quit = true;
-          break;
-        }
+         && (!max_synchronous_steps
+             || st.current_tick < max_synchronous_steps)) {
+    /* Apply the inputs given to the renderer since the last steps. */
+    if (rd) {
+      quit = atomic_load(&rd->quit);
+      debug = atomic_load(&rd->debug);
+      if (atomic_load(&rd->verbose) != verbose) {
+        verbose = !verbose;
+        log_set_verbosity_level(verbose ? LOG_DEBUG : LOG_INFO);
       }
-      if (!debug && !verbose && !quit) {
-        printf("\e[?25l");  /* Disable cursor */
-        printf("H %06.2f\tV %06.2f\tT %06.2f\tS %09d\r",
-               out.ph.ph_head, out.ph.ph_vel, out.time, out.scoreA);
-        printf("\e[?25h");  /* Re-enable cursor */
+      if (atomic_load(&rd->top) && !st.top) {
+        if (record_filename)
+          recorder_top(&rec, &st);
+        st.top = true;
+      }
+      if (atomic_exchange(&rd->dump, false))
+        hept_trace_dump();
+      int head_steps = atomic_exchange(&rd->head_steps, 0);
+      if (head_steps) {
+        st.init_phase.ph_head += 2 * head_steps;
+        if (record_filename)
+          recorder_head(&rec, &st);
       }
     }
 
-    if (!headless) {
-      /* Process events, including key presses. */
-      while (SDL_PollEvent(&e) != 0) {
-        switch (e.type) {
-        case SDL_QUIT:
-          quit = true;
-          break;
-        case SDL_KEYDOWN:
-          switch (e.key.keysym.sym) {
-          case SDLK_q:
-            quit = true;
-            break;
-          case SDLK_t:
-            top = true;
-            break;
-          case SDLK_d:
-            debug = !debug;
-            break;
-          case SDLK_v:
-            if (verbose)
-              log_set_verbosity_level(LOG_INFO);
-            else
-              log_set_verbosity_level(LOG_DEBUG);
-            verbose = !verbose;
-            break;
-          case SDLK_UP:
-            map->init_phase.ph_head += 2;
-            break;
-          case SDLK_DOWN:
-            map->init_phase.ph_head -= 2;
-            break;
-          }
-          break;
-        }
-      }
+    /* Perform the synchronous steps due by now, up to max_catch_up. */
+    size_t steps = 0;
+    while (!quit
+           && st.time_budget_ns >= sync_dt_ns
+           && (!max_catch_up || steps < max_catch_up)
+           && (!max_synchronous_steps
+               || st.current_tick < max_synchronous_steps)) {
+      st.time_budget_ns -= sync_dt_ns;
+      steps++;
+      quit = simulation_step(&st, &res);
+      if (record_filename)
+        recorder_step(&rec, &st);
+      if (rd)
+        frame_publish(&rd->frames, &st);
+    }
 
-      /* Render the scene, which includes the background as well as the car. */
-      SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0xFF);
-
-      SDL_RenderClear(r);
-      SDL_RenderCopy(r, bg, NULL, NULL);
-
-      if (!debug)
-        draw_tile(r, car, &out.ph.ph_pos, 360.f - out.ph.ph_head, car_w, car_h);
-      else {
-        /* In debug mode, render the car as a plain square. */
-        Globals__phase *ph; Globals__position endp; float f = 20.0;
-        if (top) {
-          ph = &out.ph;
-          f *= ph->ph_vel / SPEED_MAX;
-        } else
-          ph = &map->init_phase;
-        draw_rectangle(r, &ph->ph_pos, 5, 0x00, 0x00, 0x00);
-        endp.x = ph->ph_pos.x + f * cos(ph->ph_head / 360. * 2. * M_PI);
-        endp.y = ph->ph_pos.y + f * sin(ph->ph_head / 360. * 2. * M_PI);
-        SDL_SetRenderDrawColor(r, 0x00, 0x00, 0x00, 0x00);
-        draw_line(r, &ph->ph_pos, &endp);
-        SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0);
-      }
+    /* When we cannot keep up, drop the steps we are late by rather than
+       trying to catch up forever: the race then runs slower than real
+       time instead of stalling. */
+    if (!quit && st.time_budget_ns >= sync_dt_ns) {
+      size_t late = st.time_budget_ns / sync_dt_ns;
+      late_frames++;
+      dropped_steps += late;
+      log_debug("[simulation %08zu] behind real time by %.3f ms, "
+                "dropping %zu steps\n", st.current_tick,
+                st.time_budget_ns / 1e6, late);
+      st.time_budget_ns %= sync_dt_ns;
+    }
 
-      /* We draw the signalization info, when relevant. */
-      if (!debug) {
-        for (size_t i = 0; i < MAX_OBST_COUNT; i++) {
-          Globals__obstacle *o = &out.sign.si_obstacles[i];
-          if (o->o_pres)
-            draw_tile(r, obs, &o->o_pos, 0.f, obs_w, obs_h);
-        }
+    /* The renderer draws the car before the start too. */
+    if (rd && !st.top)
+      frame_publish(&rd->frames, &st);
+
+    /* Refresh the status line, then sleep until the next frame, unless this
+       one overran. */
+    uint64_t now_ns = monotonic_ns();
+    if (!debug && !verbose && !quit)
+      status_update(&status, &st, now_ns);
+    else
+      status_clear(&status);
+    if (now_ns < frame_start_ns + frame_dt_ns) {
+      sleep_until_ns(frame_start_ns + frame_dt_ns);
+      now_ns = monotonic_ns();
+    }
 
-        for (size_t i = 0; i < MAX_TL_COUNT; i++) {
-          Utilities__encode_color_out enc;
-          Globals__traflight *t = &out.sign.si_tlights[i];
-          Utilities__encode_color_step(t->tl_color, &enc);
-          draw_rectangle(r, &t->tl_pos, 10, enc.a.red, enc.a.green, enc.a.blue);
-        }
-      }
+    /* Accumulate the time elapsed for the synchronous steps. */
+    st.time_budget_ns += now_ns - frame_start_ns;
+    frame_start_ns = now_ns;
+  }
+  status_clear(&status);
 
-      /* In debug mode, we also render the raw information coming from the
-         map. This is useful to understand the map file contents. */
-      if (debug) {
-        SDL_SetRenderDrawColor(r, 0x00, 0x00, 0xFF, 0xFF);
-        for (size_t i = 0; i < map->road_sz; i++) {
-          switch (map->road_arr[i].kind) {
-          case RD_LINE_1:
-            draw_line(r,
-                      &map->road_arr[i].u.line.startp,
-                      &map->road_arr[i].u.line.endp);
-            break;
-          default:
-            /* TODO draw curved roads. */
-            break;
-          }
-        }
+  /* Keep the flight recording of the last moments before a crash. */
+  if (res == RACE_CRASH)
+    hept_trace_dump();
 
-        /* Draw waypoints. */
-        for (size_t i = 0; i < map->wayp_sz; i++)
-          draw_rectangle(r, &map->wayp_arr[i].position,
-                         10, 0xFF, 0x00, 0x00);
-
-        /* Draw traffic lights. */
-        for (size_t i = 0; i < map->tlight_sz; i++)
-          draw_rectangle(r, &map->tlight_arr[i].tl.ptl_pos,
-                         10, 0x00, 0x00, 0xFF);
-
-        /* Draw stops. */
-        for (size_t i = 0; i < map->stop_sz; i++)
-          draw_rectangle(r, &map->stop_arr[i].position,
-                         10, 0x84, 0x21, 0xFF);
-
-        /* Draw obstacles. */
-        for (size_t i = 0; i < map->obst_sz; i++)
-          draw_rectangle(r, &map->obst_arr[i].pot_pos,
-                         10, 0x12, 0xAE, 0x00);
-      }
+  if (late_frames)
+    log_info("[simulation %08zu] fell behind real time in %zu frames, "
+             "%zu steps dropped\n", st.current_tick, late_frames,
+             dropped_steps);
+  log_info("[simulation %08zu] shutting down\n", st.current_tick);
+  status_summary(&st, res);
+  if (record_filename)
+    recorder_close(&rec, &st);
 
-      SDL_RenderPresent(r);
-    }
+  return res;
+}
+
+void *simulation_thread(void *arg) {
+  race_loop_t *lp = arg;
+
+  map = lp->map;
+  log_adopt(lp->log);
+  hept_trace_attach(lp->trace);
+
+  lp->res = simulation_pace(lp);
+
+  /* Hand the trace back, then stop the renderer. */
+  lp->trace = hept_trace_detach();
+  atomic_store(&lp->rd->done, true);
+  return NULL;
+}
 
-    /* Sleep for our remaining per-simulation time. */
-    uint32_t stop_time_ms = SDL_GetTicks();
-    uint32_t frame_time_ms = stop_time_ms - start_time_ms;
-    if (frame_time_ms < simulation_dt_ms) {
-      log_debug("[simulation %08zu] %zu elapsed, sleeping for %zu ms\n",
-                current_tick, frame_time_ms, simulation_dt_ms - frame_time_ms);
-      SDL_Delay(simulation_dt_ms - frame_time_ms);
+/** Render the race of lp on the calling thread, while another one steps it */
+void render_loop(renderer_t *rd, race_loop_t *lp) {
+  SDL_Window *w;
+  SDL_Renderer *r;
+  SDL_Texture *bg, *overlay = NULL;
+  atlas_t atlas;
+  bool debug = false;
+
+  /* Initialize SDL and acquire resources. */
+
+  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
+    log_fatal("[sdl] could not initialize SDL library (%s)\n",
+              SDL_GetError());
+
+  if ((w = SDL_CreateWindow("Synchronous Contest " YEAR " v" VERSION,
+                            SDL_WINDOWPOS_UNDEFINED,
+                            SDL_WINDOWPOS_UNDEFINED,
+                            MAX_X,
+                            MAX_Y,
+                            SDL_WINDOW_SHOWN)) == NULL)
+    log_fatal("[sdl] could not open window (%s)\n", SDL_GetError());
+
+  /* Presenting waits for the display, which paces the renderer. */
+  r = SDL_CreateRenderer(w, -1,
+                         SDL_RENDERER_ACCELERATED
+                         | SDL_RENDERER_PRESENTVSYNC);
+  if (!r)
+    log_fatal("[sdl] could not create renderer (%s)\n", SDL_GetError());
+
+  /* Without vsync, or while nothing changes, we wait one display period. */
+  SDL_DisplayMode mode;
+  uint32_t display_dt_ms = 1000 / 60;
+  if (SDL_GetCurrentDisplayMode(0, &mode) == 0 && mode.refresh_rate > 0)
+    display_dt_ms = 1000 / mode.refresh_rate;
+
+  bg = load_asset_bmp_texture(rd->show_guide ? map->guide : map->graphics,
+                              r,
+                              NULL,
+                              NULL);
+  load_asset_atlas(r, &atlas);
+
+  /* Load sounds and setup audio device. */
+
+  load_asset_wav("collision.wav", &collision);
+  load_asset_wav("direction.wav", &wrong_dir);
+  load_asset_wav("exit.wav", &exit_road);
+  load_asset_wav("light.wav", &light_run);
+  load_asset_wav("speed.wav", &speed_excess);
+
+  if (rd->audio) {
+    if (!(audio_device =
+          SDL_OpenAudioDevice(NULL, 0, &collision.spec, NULL, 0))) {
+      log_info("[sdl] could not open audio device\n");
+    } else
+      SDL_PauseAudioDevice(audio_device, 0);
+  }
+
+  /* Start stepping once the sounds the synchronous program might play are
+     loaded. From now on, the map is read-only here, as the simulation owns
+     its caches. */
+  pthread_t tid;
+  lp->rd = rd;
+  if (pthread_create(&tid, NULL, simulation_thread, lp))
+    log_fatal("[simulation] could not start simulation thread\n");
+
+  bool redraw = false;          /* Wait for the first frame. */
+  while (!atomic_load(&rd->done)) {
+    SDL_Event e;
+
+    /* Process events, including key presses. */
+    while (SDL_PollEvent(&e) != 0) {
+      switch (e.type) {
+      case SDL_QUIT:
+        atomic_store(&rd->quit, true);
+        break;
+      case SDL_RENDER_TARGETS_RESET:
+        /* The overlay contents are lost, draw them again. */
+        if (overlay)
+          render_map_overlay(r, overlay);
+        redraw = true;
+        break;
+      case SDL_KEYDOWN:
+        switch (e.key.keysym.sym) {
+        case SDLK_q:
+          atomic_store(&rd->quit, true);
+          break;
+        case SDLK_t:
+          atomic_store(&rd->top, true);
+          break;
+        case SDLK_d:
+          debug = !debug;
+          if (debug && !overlay)
+            overlay = render_map_overlay(r, NULL);
+          atomic_store(&rd->debug, debug);
+          redraw = true;
+          break;
+        case SDLK_v:
+          log_set_verbosity_level(atomic_load(&rd->verbose)
+                                  ? LOG_INFO : LOG_DEBUG);
+          atomic_store(&rd->verbose, !atomic_load(&rd->verbose));
+          break;
+        case SDLK_f:
+          atomic_store(&rd->dump, true);
+          break;
+        case SDLK_UP:
+          atomic_fetch_add(&rd->head_steps, 1);
+          break;
+        case SDLK_DOWN:
+          atomic_fetch_sub(&rd->head_steps, 1);
+          break;
+        }
+        break;
+      }
     }
 
-    /* Accumulate time for the synchronous step. */
-    time_budget_ms += fmax(simulation_dt_ms, frame_time_ms);
+    /* Draw the latest frame, unless the screen already shows it. */
+    redraw = frame_acquire(&rd->frames) || redraw;
+    if (redraw) {
+      render_frame(r, &rd->frames.frames[rd->frames.front], debug,
+                   bg, overlay, &atlas);
+      redraw = false;
+    } else
+      SDL_Delay(display_dt_ms);
   }
-  log_info("[simulation %08zu] shutting down, score = %zu, time = %f\n",
-           current_tick, out.scoreA, out.time);
+
+  pthread_join(tid, NULL);
 
   /* Wait for audio queue to be empty. */
   if (audio_device) {
@@ -394,12 +863,52 @@ race_result_t simulation_loop(bool show_guide,
   free_asset_wav(&light_run);
   free_asset_wav(&speed_excess);
 
-  SDL_DestroyTexture(obs);
-  SDL_DestroyTexture(car);
+  if (overlay)
+    SDL_DestroyTexture(overlay);
+  SDL_DestroyTexture(atlas.texture);
   SDL_DestroyTexture(bg);
   SDL_DestroyRenderer(r);
   SDL_DestroyWindow(w);
   SDL_Quit();
+}
 
-  return res;
+race_result_t simulation_loop(bool show_guide,
+                              int initial_top,
+                              float sps,
+                              bool headless,
+                              bool unthrottled,
+                              bool audio,
+                              size_t max_synchronous_steps,
+                              size_t max_catch_up,
+                              const char *record_filename) {
+  race_loop_t lp = {
+    .rd = NULL,
+    .map = map,
+    .log = log_context(),
+    .initial_top = initial_top,
+    .sps = sps,
+    .unthrottled = unthrottled,
+    .max_synchronous_steps = max_synchronous_steps,
+    .max_catch_up = max_catch_up,
+    .record_filename = record_filename,
+    .res = RACE_TIMEOUT,
+  };
+
+  if (headless)
+    return simulation_pace(&lp);
+
+  /* Render on this thread, and step the race on another one. */
+  renderer_t *rd = calloc(1, sizeof *rd);
+  if (!rd)
+    log_fatal("[sdl] could not allocate renderer\n");
+  frame_buffer_init(&rd->frames);
+  rd->show_guide = show_guide;
+  rd->audio = audio;
+
+  lp.trace = hept_trace_detach();
+  render_loop(rd, &lp);
+  hept_trace_attach(lp.trace);
+
+  free(rd);
+  return lp.res;
 }
@@ -6,6 +6,10 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "challenge.h"
+#include "map.h"
 
 typedef enum {
   RACE_SUCCESS,
@@ -13,11 +17,70 @@ typedef enum {
   RACE_TIMEOUT
 } race_result_t;
 
+/* State of a race: the memory of the synchronous program, its inputs and the
+   counters driving it. Besides the map, whose contents only change through
+   caches which do not affect results, it points to the signals of the trace
+   of the thread, if any. A plain copy of the state is thus a snapshot from
+   which the race can be resumed, see simulation_fork(), but every copy which
+   runs appends its steps to the same trace: suspend tracing with
+   hept_trace_suspend() while running the copies which should not be
+   traced. */
+typedef struct {
+  Challenge__the_challenge_mem mem;          /* Synchronous state */
+  Challenge__the_challenge_out out;          /* Last outputs */
+  Globals__phase       init_phase;           /* Input, initial phase */
+  int                  top;                  /* Input, has the race started? */
+  size_t               current_tick;         /* Synchronous steps so far */
+  uint64_t             time_budget_ns;       /* Time left for steps */
+  map_t                *map;                 /* Map of the race */
+} race_state_t;
+
+/* Reset state to the start of a race on the current map. */
+void simulation_init(race_state_t *state, int top);
+
+/* Perform one synchronous step, returning true when the race is over with
+   its result in res. */
+bool simulation_step(race_state_t *state, race_result_t *res);
+
+/* Step state without pacing until the race ends, or until its tick reaches
+   max_synchronous_steps when not zero. */
+race_result_t simulation_run(race_state_t *state,
+                             size_t max_synchronous_steps);
+
+/* Snapshots: save a copy of state, restore it in place, or fork k copies
+   which can then be given different inputs and run independently, see
+   replay_check_snapshot(). Restoring makes the snapshot's map the map of
+   the calling thread.
+
+   Snapshots and forks share their map, including its lookup caches, which
+   steps update without locking. Races sharing a map must therefore run on
+   a single thread, one after the other. A snapshot may only be restored on
+   another thread once the thread which took it no longer races on that
+   map. */
+void simulation_save(const race_state_t *state, race_state_t *snapshot);
+void simulation_restore(race_state_t *state, const race_state_t *snapshot);
+race_state_t *simulation_fork(const race_state_t *snapshot, size_t k);
+
+/* Interactive races perform at most this many synchronous steps per frame
+   by default, to catch up with real time without stalling the loop. */
+#define SIMULATION_MAX_CATCH_UP 8
+
 race_result_t simulation_loop(bool show_guide,
                               int initial_top,
                               float sps,
                               bool headless,
+                              bool unthrottled,
                               bool audio,
-                              size_t max_synchronous_steps);
+                              size_t max_synchronous_steps,
+                              size_t max_catch_up,
+                              const char *record_filename);
+
+/* Run a race without graphics nor pacing, until it ends or after
+   max_synchronous_steps steps when not zero. The last outputs of the
+   synchronous program are stored in out. */
+race_result_t simulation_batch(int initial_top,
+                               size_t max_synchronous_steps,
+                               Challenge__the_challenge_out *out,
+                               size_t *current_tick);
 
 #endif  /* SIMULATION_LOOP_H */
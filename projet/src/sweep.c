@@ -0,0 +1,191 @@
+/* This file is part of SyncContest.
+   Copyright (C) 2017-2020 Eugene Asarin, Mihaela Sighireanu, Adrien Guatto. */
+
+#include "sweep.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cutils.h"
+
+#define SWEEP_SEED 0x5eed5eedULL
+
+const char *sweep_axis_names[SWEEP_AXIS_COUNT] = { "x", "y", "head" };
+
+/** Uniform double in [0, 1[, from SplitMix64 */
+double sweep_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return ((z ^ (z >> 31)) >> 11) * 0x1.0p-53;
+}
+
+/** Parse the values of one axis, false on syntax errors */
+bool sweep_parse_values(const char *s, uint64_t *state,
+                        double **values, size_t *count) {
+  char kind[8];
+  double a, b, v;
+  int n = 1, len = 0;
+
+  if (sscanf(s, "%7[a-z](%lf,%lf,%d)%n", kind, &a, &b, &n, &len) == 4
+      && s[len] == 0 && n > 0) {
+    if (strcmp(kind, "lin") && strcmp(kind, "unif") && strcmp(kind, "norm"))
+      return false;
+    *values = calloc(n, sizeof **values);
+    if (!*values)
+      log_fatal("[sweep] could not allocate offsets\n");
+    *count = n;
+
+    for (int i = 0; i < n; i++) {
+      if (strcmp(kind, "lin") == 0)
+        v = n == 1 ? a : a + (b - a) * i / (n - 1);
+      else if (strcmp(kind, "unif") == 0)
+        v = a + (b - a) * sweep_random(state);
+      else
+        /* Box-Muller transform. */
+        v = a + b * sqrt(-2 * log(1 - sweep_random(state)))
+          * cos(2 * M_PI * sweep_random(state));
+      (*values)[i] = v;
+    }
+    return true;
+  }
+
+  if (sscanf(s, "%lf%n", &v, &len) == 1 && s[len] == 0) {
+    *values = calloc(1, sizeof **values);
+    if (!*values)
+      log_fatal("[sweep] could not allocate offsets\n");
+    **values = v;
+    *count = 1;
+    return true;
+  }
+
+  return false;
+}
+
+void sweep_init(sweep_t *sweep) {
+  memset(sweep, 0, sizeof *sweep);
+  sweep->random_state = SWEEP_SEED;
+}
+
+void sweep_free(sweep_t *sweep) {
+  for (int axis = 0; axis < SWEEP_AXIS_COUNT; axis++) {
+    free(sweep->values[axis]);
+    sweep->values[axis] = NULL;
+    sweep->count[axis] = 0;
+  }
+}
+
+bool sweep_add_axis(sweep_t *sweep, const char *spec) {
+  const char *eq = strchr(spec, '=');
+  int axis;
+
+  if (!eq)
+    return false;
+  for (axis = 0; axis < SWEEP_AXIS_COUNT; axis++)
+    if (strlen(sweep_axis_names[axis]) == eq - spec
+        && strncmp(spec, sweep_axis_names[axis], eq - spec) == 0)
+      break;
+  if (axis == SWEEP_AXIS_COUNT)
+    return false;
+
+  free(sweep->values[axis]);
+  sweep->values[axis] = NULL;
+  return sweep_parse_values(eq + 1, &sweep->random_state,
+                            &sweep->values[axis], &sweep->count[axis]);
+}
+
+/** Offset i of an axis, which is 0 when the axis has not been added */
+double sweep_offset(const sweep_t *sweep, int axis, size_t i) {
+  return sweep->values[axis] ? sweep->values[axis][i] : 0.0;
+}
+
+race_job_t *sweep_jobs(const sweep_t *sweep, const char *filename,
+                       size_t *job_count) {
+  size_t count[SWEEP_AXIS_COUNT];
+
+  *job_count = 1;
+  for (int axis = 0; axis < SWEEP_AXIS_COUNT; axis++) {
+    count[axis] = sweep->values[axis] ? sweep->count[axis] : 1;
+    *job_count *= count[axis];
+  }
+
+  race_job_t *jobs = calloc(*job_count, sizeof *jobs);
+  if (!jobs)
+    log_fatal("[sweep] could not allocate races\n");
+
+  for (size_t i = 0; i < *job_count; i++) {
+    size_t k = i, idx[SWEEP_AXIS_COUNT];
+    for (int axis = SWEEP_AXIS_COUNT - 1; axis >= 0; axis--) {
+      idx[axis] = k % count[axis];
+      k /= count[axis];
+    }
+    jobs[i].map_filename = filename;
+    jobs[i].init_offset.ph_pos.x = sweep_offset(sweep, SWEEP_X, idx[SWEEP_X]);
+    jobs[i].init_offset.ph_pos.y = sweep_offset(sweep, SWEEP_Y, idx[SWEEP_Y]);
+    jobs[i].init_offset.ph_head = sweep_offset(sweep, SWEEP_HEAD,
+                                               idx[SWEEP_HEAD]);
+  }
+  return jobs;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/** Log the percentiles of n values, which get sorted */
+void sweep_report_percentiles(const char *name, double *values, size_t n) {
+  const int pct[] = { 0, 10, 25, 50, 75, 90, 100 };
+  char line[256];
+  int len = snprintf(line, sizeof line, "[sweep] %-7s", name);
+
+  qsort(values, n, sizeof *values, compare_doubles);
+  for (size_t i = 0; i < sizeof pct / sizeof *pct; i++) {
+    /* Nearest rank. */
+    size_t rank = ceil(pct[i] / 100.0 * n);
+    len += snprintf(line + len, sizeof line - len, " %10.2f",
+                    values[rank > 0 ? rank - 1 : 0]);
+  }
+  log_info("%s\n", line);
+}
+
+void sweep_report(const race_job_t *jobs, size_t job_count) {
+  const char *results[] = { "success", "crash", "timeout" };
+  size_t successes = 0;
+
+  if (job_count == 0)
+    return;
+
+  log_info("[sweep] %8s %8s %8s %-8s %8s %8s %8s\n",
+           "x", "y", "head", "result", "scoreA", "scoreB", "time");
+  for (size_t i = 0; i < job_count; i++) {
+    const race_job_t *j = &jobs[i];
+    log_info("[sweep] %8.2f %8.2f %8.2f %-8s %8d %8d %8.2f\n",
+             j->init_offset.ph_pos.x, j->init_offset.ph_pos.y,
+             j->init_offset.ph_head, results[j->result],
+             j->scoreA, j->scoreB, j->time);
+    successes += j->result == RACE_SUCCESS;
+  }
+
+  double *values = calloc(job_count, sizeof *values);
+  if (!values)
+    log_fatal("[sweep] could not allocate statistics\n");
+
+  log_info("[sweep] %zu/%zu races succeeded\n", successes, job_count);
+  log_info("[sweep] %-7s %10s %10s %10s %10s %10s %10s %10s\n",
+           "", "min", "p10", "p25", "median", "p75", "p90", "max");
+  for (size_t i = 0; i < job_count; i++)
+    values[i] = jobs[i].scoreA;
+  sweep_report_percentiles("scoreA", values, job_count);
+  for (size_t i = 0; i < job_count; i++)
+    values[i] = jobs[i].scoreB;
+  sweep_report_percentiles("scoreB", values, job_count);
+  for (size_t i = 0; i < job_count; i++)
+    values[i] = jobs[i].time;
+  sweep_report_percentiles("time", values, job_count);
+
+  free(values);
+}
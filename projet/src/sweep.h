@@ -0,0 +1,51 @@
+/* This file is part of SyncContest.
+   Copyright (C) 2017-2020 Eugene Asarin, Mihaela Sighireanu, Adrien Guatto. */
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "runner.h"
+
+/* A sweep races on one map from many initial phases. Each axis lists offsets
+   added to the x position, y position or heading of the initial phase of the
+   map, and the sweep races on every combination of them. */
+
+typedef enum {
+  SWEEP_X,
+  SWEEP_Y,
+  SWEEP_HEAD,
+  SWEEP_AXIS_COUNT
+} sweep_axis_t;
+
+typedef struct {
+  double               *values[SWEEP_AXIS_COUNT]; /* Offsets of each axis */
+  size_t               count[SWEEP_AXIS_COUNT];   /* Number of offsets */
+  uint64_t             random_state;              /* For random offsets */
+} sweep_t;
+
+void sweep_init(sweep_t *sweep);
+void sweep_free(sweep_t *sweep);
+
+/* Add an axis given as <axis>=<values>, where <axis> is x, y or head, and
+   <values> is one of
+     <v>                  the offset v,
+     lin(<a>,<b>,<n>)     n offsets evenly spaced from a to b,
+     unif(<a>,<b>,<n>)    n offsets drawn uniformly in [a, b],
+     norm(<m>,<s>,<n>)    n offsets drawn from a normal law N(m, s^2).
+   Random offsets are drawn from a fixed seed, so that sweeps are
+   reproducible. Axes which are not added stay at offset 0. Returns false on
+   syntax errors. */
+bool sweep_add_axis(sweep_t *sweep, const char *spec);
+
+/* Races of the sweep on the map in filename, to be freed by the caller. */
+race_job_t *sweep_jobs(const sweep_t *sweep, const char *filename,
+                       size_t *job_count);
+
+/* Log a table of the races and percentiles of their scores and times. */
+void sweep_report(const race_job_t *jobs, size_t job_count);
+
+#endif  /* SWEEP_H */
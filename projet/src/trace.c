@@ -1,40 +1,130 @@
 #include "trace.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "globals_types.h"
 #include "trace_lib.h"
 
-trace_file_t *trace = NULL;
-
-#define HEPT_TRACE_ENV_VAR "HEPT_TRACE"
+/* Each thread traces the race it runs. */
+_Thread_local trace_file_t *trace = NULL;
+_Thread_local char *trace_filename = NULL;
+_Thread_local trace_stream_t *trace_stream = NULL;
+_Thread_local size_t trace_stream_chunk = 0; /* 0 unless streaming */
+_Thread_local size_t trace_ring = 0;         /* 0 unless flight recording */
+_Thread_local bool trace_suspended = false;
 
 void hept_trace_init() {
-  if (trace || !getenv(HEPT_TRACE_ENV_VAR))
+  hept_trace_open(getenv(HEPT_TRACE_ENV_VAR));
+}
+
+void hept_trace_open(const char *filename) {
+  if (trace || !filename)
     return;
   trace = trace_file_alloc(TRACE_TIME_UNIT_S, 1);
+  trace_filename = strdup(filename);
+  assert (trace_filename);
+
+  const char *ring = getenv(HEPT_TRACE_RING_ENV_VAR);
+  const char *chunk = getenv(HEPT_TRACE_STREAM_ENV_VAR);
+  if (ring) {
+    double seconds = atof(ring);
+    trace_ring = seconds > 0 ? ceil(seconds / Globals__timestep) : 1;
+  } else if (chunk) {
+    int n = atoi(chunk);
+    trace_stream_chunk = n > 0 ? n : HEPT_TRACE_STREAM_CHUNK;
+  }
+}
+
+void hept_trace_cycle() {
+  if (!trace || !trace_stream_chunk || trace_suspended)
+    return;
+
+  /* The signals traced in the first cycle make the header. */
+  if (!trace_stream) {
+    trace_stream = trace_stream_open(trace, trace_filename,
+                                     trace_stream_chunk, 0);
+    if (!trace_stream) {
+      perror("trace_stream_open()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  trace_stream_cycle(trace_stream);
+}
+
+void hept_trace_dump() {
+  if (!trace || !trace_ring)
+    return;
+  if (!trace_file_write(trace, trace_filename))
+    fprintf(stderr, "[trace] could not dump to %s\n", trace_filename);
+  else
+    fprintf(stderr, "[trace] dumped up to the last %zu cycles to %s\n",
+            trace_ring, trace_filename);
+}
+
+void hept_trace_suspend(bool suspended) {
+  trace_suspended = suspended;
+}
+
+hept_trace_context_t hept_trace_detach() {
+  hept_trace_context_t context = {
+    trace, trace_filename, trace_stream, trace_stream_chunk, trace_ring,
+    trace_suspended
+  };
+  trace = NULL;
+  trace_filename = NULL;
+  trace_stream = NULL;
+  trace_stream_chunk = 0;
+  trace_ring = 0;
+  trace_suspended = false;
+  return context;
+}
+
+void hept_trace_attach(hept_trace_context_t context) {
+  assert (!trace);
+  trace = context.file;
+  trace_filename = context.filename;
+  trace_stream = context.stream;
+  trace_stream_chunk = context.stream_chunk;
+  trace_ring = context.ring;
+  trace_suspended = context.suspended;
 }
 
 void hept_trace_quit() {
   if (trace) {
-    trace_file_write(trace, getenv(HEPT_TRACE_ENV_VAR));
+    /* Flight recordings are only written on demand. */
+    if (trace_stream)
+      trace_stream_close(trace_stream);
+    else if (!trace_ring)
+      trace_file_write(trace, trace_filename);
     trace_file_free(trace);
+    free(trace_filename);
     trace = NULL;
+    trace_filename = NULL;
+    trace_stream = NULL;
+    trace_stream_chunk = 0;
+    trace_ring = 0;
   }
 }
 
 static inline void trace_samples(trace_signal_t **signal,
                           const char *name, trace_signal_type_t type,
                           void *samples, size_t count) {
-  if (!trace)
+  if (!trace || trace_suspended)
     return;
 
   if (!*signal) {
     *signal = trace_file_lookup_signal(trace, name);
     if (!*signal) {
-      *signal = trace_signal_alloc(name, type, 1 << 17);
+      /* Streams only hold the samples of the current cycle. */
+      if (trace_ring)
+        *signal = trace_signal_alloc_ring(name, type, trace_ring);
+      else
+        *signal = trace_signal_alloc(name, type,
+                                     trace_stream_chunk ? 4 : 1 << 17);
       if (!trace_file_add_signal(trace, *signal)) {
         perror("trace_file_add_signal()\n");
         exit(EXIT_FAILURE);
@@ -7,9 +7,43 @@
 #include "hept_ffi.h"
 #include "trace_lib.h"
 
-void hept_trace_init();
+#define HEPT_TRACE_ENV_VAR "HEPT_TRACE"
+
+/* When $HEPT_TRACE_STREAM is set, the trace is written while the race runs,
+   by chunks of $HEPT_TRACE_STREAM cycles (HEPT_TRACE_STREAM_CHUNK when it
+   is not a positive number), instead of being kept in memory until the
+   end. */
+#define HEPT_TRACE_STREAM_ENV_VAR "HEPT_TRACE_STREAM"
+#define HEPT_TRACE_STREAM_CHUNK 4096
+
+/* When $HEPT_TRACE_RING is set to a number of seconds, each signal only keeps
+   its samples over that many seconds of race, which are written by
+   hept_trace_dump() only, for instance after a crash. This takes precedence
+   over streaming. */
+#define HEPT_TRACE_RING_ENV_VAR "HEPT_TRACE_RING"
+
+void hept_trace_init();                 /* trace to $HEPT_TRACE, if set */
+void hept_trace_open(const char *);     /* trace to a file, if not NULL */
+void hept_trace_cycle();                /* end of a synchronous step */
+void hept_trace_dump();                 /* write the ring of the last cycles */
+void hept_trace_suspend(bool);          /* drop samples while suspended */
 void hept_trace_quit();
 
+/* A trace belongs to the thread which opened it. It moves to another thread,
+   such as the one stepping an interactive race, when the former detaches it
+   and the latter attaches it. */
+typedef struct {
+  trace_file_t *file;
+  char *filename;
+  trace_stream_t *stream;
+  size_t stream_chunk;
+  size_t ring;
+  bool suspended;
+} hept_trace_context_t;
+
+hept_trace_context_t hept_trace_detach();
+void hept_trace_attach(hept_trace_context_t context);
+
 DECLARE_HEPT_NODE(Trace, trace_bool, (string, int),, trace_signal_t *signal);
 DECLARE_HEPT_NODE(Trace, trace_int, (string, int),, trace_signal_t *signal);
 DECLARE_HEPT_NODE(Trace, trace_float, (string, float),, trace_signal_t *signal);
@@ -1,13 +1,20 @@
 #include "trace_lib.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifdef HTRC_ZLIB
+#include <zlib.h>
+#endif
+
 #include "buffer.h"
+#include "htrc.h"
 
 size_t trace_sizeof_signal_type(trace_signal_type_t type) {
   switch (type) {
@@ -26,17 +33,42 @@ size_t trace_sizeof_signal_type(trace_signal_type_t type) {
 typedef struct trace_signal {
   char *name;
   trace_signal_type_t type;
+  size_t id;                  /* Index in its trace file */
   buffer_t *samples;
+  size_t ring;                /* Capacity in samples of a ring, 0 if none */
+  size_t count;               /* Samples added to a ring so far */
 } trace_signal_t;
 
-trace_signal_t *trace_signal_alloc(const char *name,
-                               trace_signal_type_t type,
-                               size_t initial_buffer_size) {
+trace_signal_t *trace_signal_alloc_in(const char *name,
+                                      trace_signal_type_t type,
+                                      buffer_t *samples) {
   trace_signal_t *res = malloc_checked(sizeof *res);
   res->name = strdup_checked(name);
   res->type = type;
-  res->samples =
-    buffer_alloc(initial_buffer_size * trace_sizeof_signal_type(type));
+  res->id = 0;
+  res->samples = samples;
+  res->ring = 0;
+  res->count = 0;
+  return res;
+}
+
+trace_signal_t *trace_signal_alloc(const char *name,
+                               trace_signal_type_t type,
+                               size_t initial_buffer_size) {
+  /* Long traces grow by segments, without copying their samples. */
+  return trace_signal_alloc_in(name, type,
+    buffer_alloc_segmented(initial_buffer_size
+                           * trace_sizeof_signal_type(type)));
+}
+
+trace_signal_t *trace_signal_alloc_ring(const char *name,
+                                        trace_signal_type_t type,
+                                        size_t capacity) {
+  assert (capacity > 0);
+
+  trace_signal_t *res = trace_signal_alloc_in(name, type,
+    buffer_alloc(capacity * trace_sizeof_signal_type(type)));
+  res->ring = capacity;
   return res;
 }
 
@@ -51,9 +83,34 @@ void trace_signal_free(trace_signal_t *signal) {
 void trace_add_samples(trace_signal_t *signal, void *samples, size_t count) {
   assert (signal);
   assert (samples);
-  buffer_write(signal->samples,
-               samples,
-               count * trace_sizeof_signal_type(signal->type));
+
+  size_t sz = trace_sizeof_signal_type(signal->type);
+
+  if (!signal->ring) {
+    buffer_write(signal->samples, samples, count * sz);
+    return;
+  }
+
+  /* Overwrite the oldest samples of the ring. */
+  for (size_t i = 0; i < count; i++, signal->count++)
+    memcpy(signal->samples->data + (signal->count % signal->ring) * sz,
+           (unsigned char *)samples + i * sz, sz);
+}
+
+/** Samples available in signal */
+size_t trace_signal_length(const trace_signal_t *signal) {
+  if (!signal->ring)
+    return signal->samples->occupancy / trace_sizeof_signal_type(signal->type);
+  return signal->count < signal->ring ? signal->count : signal->ring;
+}
+
+/** Sample k of the available samples of signal, oldest first */
+void *trace_signal_sample(const trace_signal_t *signal, size_t k) {
+  size_t sz = trace_sizeof_signal_type(signal->type);
+
+  if (signal->ring && signal->count > signal->ring)
+    k = (signal->count + k) % signal->ring;
+  return buffer_at(signal->samples, k * sz);
 }
 
 const char *trace_time_unit_repr(trace_time_unit_t u) {
@@ -113,15 +170,31 @@ bool trace_file_add_signal(const trace_file_t *trace, trace_signal_t *signal) {
   if (trace_file_lookup_signal(trace, signal->name))
     return false;
 
+  signal->id = trace->signals->occupancy / sizeof signal;
   buffer_write(trace->signals, &signal, sizeof signal);
   return true;
 }
 
-typedef void (trace_backend_write_header_f)(FILE *, trace_file_t *);
-typedef void (trace_backend_write_cycle_beg_f)(FILE *, size_t);
-typedef void (trace_backend_write_cycle_end_f)(FILE *, size_t);
-typedef void (trace_backend_write_sample_f)(FILE *, trace_signal_t *, void *);
-typedef void (trace_backend_write_sample_missing_f)(FILE *, trace_signal_t *);
+/* Backends write to an output, which holds the signals of the header and the
+   state of the backend between callbacks. The id of a signal is its index
+   among these signals. */
+
+typedef struct trace_output {
+  FILE *f;
+  trace_file_t *trace;
+  trace_signal_t **signals;
+  size_t signal_count;
+  void *state;                        /* Owned by the backend */
+} trace_output_t;
+
+typedef void (trace_backend_write_header_f)(trace_output_t *);
+typedef void (trace_backend_write_cycle_beg_f)(trace_output_t *, size_t);
+typedef void (trace_backend_write_cycle_end_f)(trace_output_t *, size_t);
+typedef void (trace_backend_write_sample_f)(trace_output_t *,
+                                            trace_signal_t *, void *);
+typedef void (trace_backend_write_sample_missing_f)(trace_output_t *,
+                                                    trace_signal_t *);
+typedef void (trace_backend_write_footer_f)(trace_output_t *);
 
 typedef struct trace_backend {
   char *file_extension;
@@ -130,23 +203,70 @@ typedef struct trace_backend {
   trace_backend_write_cycle_end_f *write_cycle_end;
   trace_backend_write_sample_f *write_sample;
   trace_backend_write_sample_missing_f *write_sample_missing;
+  trace_backend_write_footer_f *write_footer;
 } trace_backend_t;
 
-void trace_file_write_vcd_header(FILE *f, trace_file_t *trace) {
+/* The VCD backend only writes the samples that differ from the previous one
+   of their signal, after the marker of their cycle. The first cycle goes in
+   the $dumpvars section, and the last cycle is always marked so that the
+   dump lasts until the end of the trace. */
+
+typedef enum vcd_value_state {
+  VCD_VALUE_UNSET,                    /* Nothing written yet */
+  VCD_VALUE_SET,                      /* Last written value in last */
+  VCD_VALUE_X,                        /* Last written value unknown */
+} vcd_value_state_t;
+
+typedef struct vcd_writer {
+  size_t cycle;                       /* Current cycle */
+  bool marked;                        /* Whether #cycle was written */
+  bool started;                       /* Whether a cycle was written */
+  bool dumpvars;                      /* Whether in the $dumpvars section */
+  uint32_t *last;
+  vcd_value_state_t *state;
+} vcd_writer_t;
+
+#define VCD_ID_FIRST '!'
+#define VCD_ID_BASE ('~' - '!' + 1)
+
+/** Print the short identifier code of sig, in base 94 printable ASCII */
+void vcd_write_id(FILE *f, trace_signal_t *sig) {
+  size_t id = sig->id;
+
+  do {
+    putc(VCD_ID_FIRST + id % VCD_ID_BASE, f);
+    id /= VCD_ID_BASE;
+  } while (id);
+}
+
+void trace_file_write_vcd_header(trace_output_t *out) {
+  FILE *f = out->f;
   time_t current_time;
   time(&current_time);
 
+  vcd_writer_t *w = malloc_checked(sizeof *w);
+  w->cycle = 0;
+  w->marked = false;
+  w->started = false;
+  w->dumpvars = false;
+  w->last = malloc_checked((out->signal_count + 1) * sizeof *w->last);
+  w->state = malloc_checked((out->signal_count + 1) * sizeof *w->state);
+  for (size_t i = 0; i < out->signal_count; i++)
+    w->state[i] = VCD_VALUE_UNSET;
+  out->state = w;
+
   fprintf(f, "$version Generated by trace.c $end\n");
   fprintf(f, "$date %s $end\n", ctime(&current_time));
   fprintf(f, "$timescale %zu %s $end\n",
-          trace->time_unit_factor,
-          trace_time_unit_repr(trace->time_unit));
+          out->trace->time_unit_factor,
+          trace_time_unit_repr(out->trace->time_unit));
 
   /* Dump signal declarations. */
   fprintf(f, "$scope module Top $end\n");
-  buffer_foreach (trace_signal_t *, psig, trace->signals) {
+  for (size_t i = 0; i < out->signal_count; i++) {
+    trace_signal_t *sig = out->signals[i];
     fprintf(f, "$var ");
-    switch ((*psig)->type) {
+    switch (sig->type) {
     case TRACE_SIGNAL_TYPE_BOOL:
       fprintf(f, "wire 1");
       break;
@@ -157,69 +277,320 @@ void trace_file_write_vcd_header(FILE *f, trace_file_t *trace) {
       fprintf(f, "real 32");
       break;
     }
-    fprintf(f, " %p %s $end\n", (*psig), (*psig)->name);
+    putc(' ', f);
+    vcd_write_id(f, sig);
+    fprintf(f, " %s $end\n", sig->name);
   }
   fprintf(f, "$upscope $end\n");
-  fprintf(f, "$enddefinitions\n");
+  fprintf(f, "$enddefinitions $end\n");
+}
+
+void trace_file_write_vcd_cycle_beg(trace_output_t *out, size_t cycle) {
+  vcd_writer_t *w = out->state;
+
+  w->cycle = cycle;
+  w->marked = false;
 
-  /* Dump samples. */
-  fprintf(f, "$dumpvars\n");
+  /* Dump the initial value of every signal. */
+  if (!w->started) {
+    fprintf(out->f, "#%zu\n$dumpvars\n", cycle);
+    w->marked = true;
+    w->started = true;
+    w->dumpvars = true;
+  }
 }
 
-void trace_file_write_vcd_cycle_beg(FILE *f, size_t cycle) {
-  fprintf(f, "#%zu\n", cycle);
+void trace_file_write_vcd_cycle_end(trace_output_t *out, size_t cycle) {
+  vcd_writer_t *w = out->state;
+
+  if (w->dumpvars)
+    fprintf(out->f, "$end\n");
+  w->dumpvars = false;
 }
 
-void trace_file_write_vcd_cycle_end(FILE *f, size_t cycle) {
+/** Write the marker of the current cycle before its first change */
+void vcd_mark_cycle(trace_output_t *out) {
+  vcd_writer_t *w = out->state;
+
+  if (!w->marked)
+    fprintf(out->f, "#%zu\n", w->cycle);
+  w->marked = true;
 }
 
-void trace_file_write_vcd_sample(FILE *f, trace_signal_t *sig, void *sample) {
+void trace_file_write_vcd_sample(trace_output_t *out, trace_signal_t *sig,
+                                 void *sample) {
+  vcd_writer_t *w = out->state;
+  FILE *f = out->f;
+  uint32_t v;
+
+  memcpy(&v, sample, sizeof v);
+  if (sig->type == TRACE_SIGNAL_TYPE_BOOL)
+    v = v ? 1 : 0;
+  if (w->state[sig->id] == VCD_VALUE_SET && w->last[sig->id] == v)
+    return;
+  w->state[sig->id] = VCD_VALUE_SET;
+  w->last[sig->id] = v;
+
+  vcd_mark_cycle(out);
   switch (sig->type) {
   case TRACE_SIGNAL_TYPE_BOOL:
-    fprintf(f, "%d%p\n", (*(int *)sample ? 1 : 0), sig);
+    fprintf(f, "%u", v);
     break;
-  case TRACE_SIGNAL_TYPE_INT:
-    fprintf(f, "r%d %p\n", *(int *)sample, sig);
+  case TRACE_SIGNAL_TYPE_INT: {
+    int bit = 31;
+    while (bit > 0 && !(v >> bit & 1))
+      bit--;
+    putc('b', f);
+    for (; bit >= 0; bit--)
+      putc('0' + (v >> bit & 1), f);
+    putc(' ', f);
     break;
+  }
   case TRACE_SIGNAL_TYPE_FLOAT:
-    fprintf(f, "r%.16g %p\n", *(float *)sample, sig);
+    fprintf(f, "r%.16g ", *(float *)sample);
     break;
   }
+  vcd_write_id(f, sig);
+  putc('\n', f);
 }
 
-void trace_file_write_vcd_sample_missing(FILE *f, trace_signal_t *sig) {
+void trace_file_write_vcd_sample_missing(trace_output_t *out,
+                                         trace_signal_t *sig) {
+  vcd_writer_t *w = out->state;
+
+  /* Reals have no unknown value, they keep their last one. */
+  if (w->state[sig->id] == VCD_VALUE_X
+      || sig->type == TRACE_SIGNAL_TYPE_FLOAT)
+    return;
+  w->state[sig->id] = VCD_VALUE_X;
+
+  vcd_mark_cycle(out);
+  fprintf(out->f, sig->type == TRACE_SIGNAL_TYPE_BOOL ? "x" : "bx ");
+  vcd_write_id(out->f, sig);
+  putc('\n', out->f);
 }
 
-void trace_file_write_csv_header(FILE *f, trace_file_t *trace) {
-  buffer_foreach (trace_signal_t *, psig, trace->signals) {
-    fprintf(f, "%s,", (*psig)->name);
-  }
-  fprintf(f, "\n");
+void trace_file_write_vcd_footer(trace_output_t *out) {
+  vcd_writer_t *w = out->state;
+
+  if (w->started)
+    vcd_mark_cycle(out);
+
+  free(w->last);
+  free(w->state);
+  free(w);
+  out->state = NULL;
 }
 
-void trace_file_write_csv_cycle_beg(FILE *f, size_t cycle) {
+void trace_file_write_csv_header(trace_output_t *out) {
+  for (size_t i = 0; i < out->signal_count; i++)
+    fprintf(out->f, "%s,", out->signals[i]->name);
+  fprintf(out->f, "\n");
 }
 
-void trace_file_write_csv_cycle_end(FILE *f, size_t cycle) {
-  fprintf(f, "\n");
+void trace_file_write_csv_cycle_beg(trace_output_t *out, size_t cycle) {
 }
 
-void trace_file_write_csv_sample(FILE *f, trace_signal_t *sig, void *sample) {
+void trace_file_write_csv_cycle_end(trace_output_t *out, size_t cycle) {
+  fprintf(out->f, "\n");
+}
+
+void trace_file_write_csv_sample(trace_output_t *out, trace_signal_t *sig,
+                                 void *sample) {
   switch (sig->type) {
   case TRACE_SIGNAL_TYPE_BOOL:
-    fprintf(f, "%d,", (*(int *)sample ? 1 : 0));
+    fprintf(out->f, "%d,", (*(int *)sample ? 1 : 0));
     break;
   case TRACE_SIGNAL_TYPE_INT:
-    fprintf(f, "%d,", *(int *)sample);
+    fprintf(out->f, "%d,", *(int *)sample);
     break;
   case TRACE_SIGNAL_TYPE_FLOAT:
-    fprintf(f, "%f,", *(float *)sample);
+    fprintf(out->f, "%f,", *(float *)sample);
     break;
   }
 }
 
-void trace_file_write_csv_sample_missing(FILE *f, trace_signal_t *sig) {
-  fprintf(f, "XXX,");
+void trace_file_write_csv_sample_missing(trace_output_t *out,
+                                         trace_signal_t *sig) {
+  fprintf(out->f, "XXX,");
+}
+
+void trace_file_write_csv_footer(trace_output_t *out) {
+}
+
+/* The .htrc backend, described in htrc.h, encodes each signal in a column
+   of its own until a block is complete, then writes the columns of the
+   block together. */
+
+typedef struct htrc_column {
+  buffer_t *runs;                     /* Lengths of the complete runs */
+  buffer_t *values;                   /* Encoded present samples */
+  bool present;                       /* Whether the current run is present */
+  size_t run;                         /* Length of the current run */
+  uint32_t prev;                      /* Previous sample */
+} htrc_column_t;
+
+typedef struct htrc_writer {
+  size_t first_cycle;
+  size_t cycles;                      /* Cycles in the current block */
+  htrc_column_t *columns;
+  buffer_t *raw;                      /* The block, before compression */
+  unsigned char *stored;
+  size_t stored_size;
+} htrc_writer_t;
+
+void htrc_write_varint(buffer_t *buff, uint64_t v) {
+  unsigned char bytes[10];
+  buffer_write(buff, bytes, htrc_put_varint(bytes, v));
+}
+
+void htrc_fwrite_varint(FILE *f, uint64_t v) {
+  unsigned char bytes[10];
+  fwrite(bytes, 1, htrc_put_varint(bytes, v), f);
+}
+
+void trace_file_write_htrc_header(trace_output_t *out) {
+  htrc_writer_t *w = malloc_checked(sizeof *w);
+  w->first_cycle = 0;
+  w->cycles = 0;
+  w->columns = malloc_checked((out->signal_count + 1) * sizeof *w->columns);
+  for (size_t i = 0; i < out->signal_count; i++) {
+    w->columns[i].runs = buffer_alloc(64);
+    w->columns[i].values = buffer_alloc(2 * HTRC_BLOCK_CYCLES);
+    w->columns[i].present = true;
+    w->columns[i].run = 0;
+    w->columns[i].prev = 0;
+  }
+  w->raw = buffer_alloc(2 * HTRC_BLOCK_CYCLES * (out->signal_count + 1));
+  w->stored = NULL;
+  w->stored_size = 0;
+  out->state = w;
+
+  fwrite(HTRC_MAGIC, 1, strlen(HTRC_MAGIC), out->f);
+  putc(HTRC_VERSION, out->f);
+  putc(out->trace->time_unit, out->f);
+  htrc_fwrite_varint(out->f, out->trace->time_unit_factor);
+  htrc_fwrite_varint(out->f, out->signal_count);
+  for (size_t i = 0; i < out->signal_count; i++) {
+    size_t len = strlen(out->signals[i]->name);
+    putc(out->signals[i]->type, out->f);
+    htrc_fwrite_varint(out->f, len);
+    fwrite(out->signals[i]->name, 1, len, out->f);
+  }
+}
+
+void htrc_flush_block(trace_output_t *out) {
+  htrc_writer_t *w = out->state;
+
+  if (!w->cycles)
+    return;
+
+  /* Gather the columns. */
+  w->raw->occupancy = 0;
+  for (size_t i = 0; i < out->signal_count; i++) {
+    htrc_column_t *col = &w->columns[i];
+    htrc_write_varint(col->runs, col->run);
+    htrc_write_varint(w->raw, col->runs->occupancy + col->values->occupancy);
+    buffer_write(w->raw, col->runs->data, col->runs->occupancy);
+    buffer_write(w->raw, col->values->data, col->values->occupancy);
+    col->runs->occupancy = 0;
+    col->values->occupancy = 0;
+    col->present = true;
+    col->run = 0;
+    col->prev = 0;
+  }
+
+  /* Only keep the compressed block when it is smaller. */
+  int flags = 0;
+  unsigned char *payload = w->raw->data;
+  size_t size = w->raw->occupancy;
+#ifdef HTRC_ZLIB
+  uLongf len = compressBound(size);
+  if (len > w->stored_size) {
+    free(w->stored);
+    w->stored = malloc_checked(len);
+    w->stored_size = len;
+  }
+  if (compress2(w->stored, &len, payload, size, Z_BEST_SPEED) == Z_OK
+      && len < size) {
+    flags |= HTRC_BLOCK_ZLIB;
+    payload = w->stored;
+  }
+#endif
+
+  htrc_fwrite_varint(out->f, w->first_cycle);
+  htrc_fwrite_varint(out->f, w->cycles);
+  putc(flags, out->f);
+  htrc_fwrite_varint(out->f, size);
+#ifdef HTRC_ZLIB
+  if (flags & HTRC_BLOCK_ZLIB)
+    size = len;
+#endif
+  htrc_fwrite_varint(out->f, size);
+  fwrite(payload, 1, size, out->f);
+
+  w->cycles = 0;
+}
+
+void trace_file_write_htrc_cycle_beg(trace_output_t *out, size_t cycle) {
+  htrc_writer_t *w = out->state;
+
+  if (!w->cycles)
+    w->first_cycle = cycle;
+}
+
+void trace_file_write_htrc_cycle_end(trace_output_t *out, size_t cycle) {
+  htrc_writer_t *w = out->state;
+
+  if (++w->cycles == HTRC_BLOCK_CYCLES)
+    htrc_flush_block(out);
+}
+
+/** Extend the runs of col with a present or missing sample */
+void htrc_column_run(htrc_column_t *col, bool present) {
+  if (col->present != present) {
+    htrc_write_varint(col->runs, col->run);
+    col->present = present;
+    col->run = 0;
+  }
+  col->run++;
+}
+
+void trace_file_write_htrc_sample(trace_output_t *out, trace_signal_t *sig,
+                                  void *sample) {
+  htrc_writer_t *w = out->state;
+  htrc_column_t *col = &w->columns[sig->id];
+  uint32_t v;
+
+  memcpy(&v, sample, sizeof v);
+  htrc_column_run(col, true);
+  if (sig->type == TRACE_SIGNAL_TYPE_FLOAT)
+    htrc_write_varint(col->values, v ^ col->prev);
+  else
+    htrc_write_varint(col->values, htrc_zigzag(v - col->prev));
+  col->prev = v;
+}
+
+void trace_file_write_htrc_sample_missing(trace_output_t *out,
+                                          trace_signal_t *sig) {
+  htrc_writer_t *w = out->state;
+  htrc_column_run(&w->columns[sig->id], false);
+}
+
+void trace_file_write_htrc_footer(trace_output_t *out) {
+  htrc_writer_t *w = out->state;
+
+  htrc_flush_block(out);
+
+  for (size_t i = 0; i < out->signal_count; i++) {
+    buffer_free(w->columns[i].runs);
+    buffer_free(w->columns[i].values);
+  }
+  free(w->columns);
+  buffer_free(w->raw);
+  free(w->stored);
+  free(w);
+  out->state = NULL;
 }
 
 trace_backend_t backends[] = {
@@ -230,6 +601,7 @@ trace_backend_t backends[] = {
     trace_file_write_vcd_cycle_end,
     trace_file_write_vcd_sample,
     trace_file_write_vcd_sample_missing,
+    trace_file_write_vcd_footer,
   },
   {
     ".csv",
@@ -238,91 +610,305 @@ trace_backend_t backends[] = {
     trace_file_write_csv_cycle_end,
     trace_file_write_csv_sample,
     trace_file_write_csv_sample_missing,
+    trace_file_write_csv_footer,
+  },
+  {
+    ".htrc",
+    trace_file_write_htrc_header,
+    trace_file_write_htrc_cycle_beg,
+    trace_file_write_htrc_cycle_end,
+    trace_file_write_htrc_sample,
+    trace_file_write_htrc_sample_missing,
+    trace_file_write_htrc_footer,
   },
 };
 
+/** Backend of file_name, from its extension, NULL if there is none */
+trace_backend_t *trace_backend_find(const char *file_name) {
+  char *file_ext;
+
+  if (!(file_ext = strrchr(file_name, '.'))) {
+    fprintf(stderr, "[trace] could not determine file extension of %s\n",
+            file_name);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < sizeof(backends) / sizeof(trace_backend_t); i++)
+    if (!strcmp(backends[i].file_extension, file_ext))
+      return &backends[i];
+
+  fprintf(stderr, "[trace] unknown file extension \"%s\"\n", file_ext);
+  return NULL;
+}
+
 bool trace_file_write(trace_file_t *trace, const char *file_name) {
   assert (trace);
   assert (file_name);
 
+  trace_backend_t *backend = trace_backend_find(file_name);
+  if (!backend)
+    return false;
+
   FILE *f = fopen(file_name, "w");
 
   if (!f)
     return false;
 
-  trace_backend_t *backend = NULL;
-  char *file_ext;
+  size_t signal_count = trace->signals->occupancy / sizeof(trace_signal_t *);
+  trace_signal_t **signals = (trace_signal_t **)trace->signals->data;
+  trace_output_t out = { f, trace, signals, signal_count, NULL };
 
-  /* Search for the backend. */
+  /* Write header. */
+  backend->write_header(&out);
 
-  if (!(file_ext = strrchr(file_name, '.'))) {
-    fprintf(stderr, "[trace] could not determine file extension of %s\n",
-            file_name);
-    return false;
+  /* Write samples. */
+
+  /* Signals start together, at the first cycle. Rings only hold their last
+     samples, so they rather end together, at the last cycle. */
+  size_t *skip = calloc(signal_count, sizeof *skip);
+  size_t cycles = 0, first_cycle = 0;
+  assert (skip);
+
+  for (size_t i = 0; i < signal_count; i++) {
+    size_t n = trace_signal_length(signals[i]);
+    cycles = n > cycles ? n : cycles;
+    if (signals[i]->ring && signals[i]->count - n > first_cycle)
+      first_cycle = signals[i]->count - n;
   }
+  for (size_t i = 0; i < signal_count; i++)
+    if (signals[i]->ring)
+      skip[i] = cycles - trace_signal_length(signals[i]);
 
-  for (size_t i = 0; i < sizeof(backends) / sizeof(trace_backend_t); i++) {
-    if (!strcmp(backends[i].file_extension, file_ext)) {
-      backend = &backends[i];
-      break;
+  /* Consume one sample from each non-depleted signal at each cycle. */
+  for (size_t cycle = 0; cycle < cycles; cycle++) {
+    /* Write cycle-start marker. */
+    backend->write_cycle_beg(&out, first_cycle + cycle);
+
+    /* Write each sample, including missing ones. */
+    for (size_t i = 0; i < signal_count; i++) {
+      trace_signal_t *sig = signals[i];
+
+      if (skip[i] <= cycle && cycle - skip[i] < trace_signal_length(sig))
+        backend->write_sample(&out, sig,
+                              trace_signal_sample(sig, cycle - skip[i]));
+      else
+        backend->write_sample_missing(&out, sig);
     }
-  }
 
-  if (!backend) {
-    fprintf(stderr, "[trace] unknown file extension \"%s\"\n", file_ext);
-    return false;
+    /* Write cycle-stop marker. */
+    backend->write_cycle_end(&out, first_cycle + cycle);
   }
 
-  /* Write header. */
-  backend->write_header(f, trace);
-
-  /* Write samples. */
+  backend->write_footer(&out);
+  free(skip);
 
-  /* We maintain an array of pointers to the current samples in each signal, and
-     walk through them as long as none of them is finished. */
-  size_t signal_count = trace->signals->occupancy / sizeof(trace_signal_t *);
-  unsigned char **psamples = calloc(signal_count, sizeof(unsigned char *));
-  assert (psamples);
-  for (size_t i = 0; i < signal_count; i++)
-    psamples[i] = ((trace_signal_t **)trace->signals->data)[i]->samples->data;
+  bool ok = !ferror(f);
+  return (fclose(f) == 0) && ok;
+}
 
-  /* Loop until all signals have been depleted, consuming one sample from each
-     non-depleted signal at each cycle. */
-  for (size_t cycle = 0;; cycle++) {
-    /* Check if there is at least one active sample. */
-    bool active = false;
-    for (size_t i = 0; i < signal_count; i++) {
-      trace_signal_t *sig = ((trace_signal_t **)trace->signals->data)[i];
-      if (psamples[i] < sig->samples->data + sig->samples->occupancy) {
-        active = true;
-        break;
-      }
+/* Streaming: a stream writes the samples of each complete cycle, gathered in
+   chunks of chunk_cycles cycles which a writer thread hands over to the
+   backend. The simulation fills one chunk while the writer drains the other,
+   so memory stays bounded however long the trace. The signals are those
+   known when the stream opens, since the backends write them in the header
+   first. */
+
+#define TRACE_SAMPLE_SIZE sizeof(int)
+
+typedef struct trace_chunk {
+  size_t first_cycle;
+  size_t cycles;                      /* Complete cycles in the chunk */
+  unsigned char *samples;             /* cycles x signals samples */
+  bool *present;                      /* Whether each sample was traced */
+} trace_chunk_t;
+
+typedef struct trace_stream {
+  trace_file_t *trace;
+  trace_backend_t *backend;
+  trace_output_t out;                 /* Owned by the writer once open */
+  trace_signal_t **signals;           /* Signals in the header */
+  size_t signal_count;
+  size_t chunk_cycles;
+  size_t cycle;                       /* Current cycle */
+  bool dropped;                       /* Some late signals were dropped */
+  trace_chunk_t chunks[2];
+  trace_chunk_t *fill;                /* Filled by the simulation */
+  trace_chunk_t *pending;             /* Written, NULL if the writer idles */
+  bool closing;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} trace_stream_t;
+
+void trace_stream_write_chunk(trace_stream_t *stream, trace_chunk_t *chunk) {
+  unsigned char *sample = chunk->samples;
+  bool *present = chunk->present;
+
+  trace_output_t *out = &stream->out;
+
+  for (size_t c = 0; c < chunk->cycles; c++) {
+    stream->backend->write_cycle_beg(out, chunk->first_cycle + c);
+    for (size_t i = 0; i < stream->signal_count; i++) {
+      if (*present++)
+        stream->backend->write_sample(out, stream->signals[i], sample);
+      else
+        stream->backend->write_sample_missing(out, stream->signals[i]);
+      sample += TRACE_SAMPLE_SIZE;
     }
+    stream->backend->write_cycle_end(out, chunk->first_cycle + c);
+  }
+}
 
-    if (!active)
+void *trace_stream_writer(void *arg) {
+  trace_stream_t *stream = arg;
+
+  pthread_mutex_lock(&stream->lock);
+  for (;;) {
+    while (!stream->pending && !stream->closing)
+      pthread_cond_wait(&stream->cond, &stream->lock);
+    if (!stream->pending)
       break;
 
-    /* Write cycle-start marker. */
-    backend->write_cycle_beg(f, cycle);
+    trace_chunk_t *chunk = stream->pending;
+    pthread_mutex_unlock(&stream->lock);
+    trace_stream_write_chunk(stream, chunk);
+    pthread_mutex_lock(&stream->lock);
 
-    /* Write each sample, including missing ones. */
-    for (size_t i = 0; i < signal_count; i++) {
-      trace_signal_t *sig = ((trace_signal_t **)trace->signals->data)[i];
-
-      if (psamples[i] < sig->samples->data + sig->samples->occupancy) {
-        active = true;
-        backend->write_sample(f, sig, psamples[i]);
-        psamples[i] += trace_sizeof_signal_type(sig->type);
-      } else
-        backend->write_sample_missing(f, sig);
-    }
+    stream->pending = NULL;
+    pthread_cond_broadcast(&stream->cond);
+  }
+  pthread_mutex_unlock(&stream->lock);
+  return NULL;
+}
 
-    /* Write cycle-stop marker. */
-    backend->write_cycle_end(f, cycle);
+trace_stream_t *trace_stream_open(trace_file_t *trace, const char *file_name,
+                                  size_t chunk_cycles, size_t first_cycle) {
+  assert (trace);
+  assert (file_name);
+  assert (chunk_cycles > 0);
+
+  trace_backend_t *backend = trace_backend_find(file_name);
+  if (!backend)
+    return NULL;
+
+  FILE *f = fopen(file_name, "w");
+  if (!f)
+    return NULL;
+
+  trace_stream_t *stream = malloc_checked(sizeof *stream);
+  stream->trace = trace;
+  stream->backend = backend;
+  stream->signal_count = trace->signals->occupancy / sizeof(trace_signal_t *);
+  stream->signals =
+    malloc_checked((stream->signal_count + 1) * sizeof *stream->signals);
+  memcpy(stream->signals, trace->signals->data,
+         stream->signal_count * sizeof *stream->signals);
+  stream->chunk_cycles = chunk_cycles;
+  stream->cycle = first_cycle;
+  stream->dropped = false;
+
+  size_t n = chunk_cycles * stream->signal_count;
+  for (int i = 0; i < 2; i++) {
+    stream->chunks[i].first_cycle = first_cycle;
+    stream->chunks[i].cycles = 0;
+    stream->chunks[i].samples = malloc_checked(n * TRACE_SAMPLE_SIZE + 1);
+    stream->chunks[i].present = malloc_checked(n * sizeof(bool) + 1);
   }
+  stream->fill = &stream->chunks[0];
+  stream->pending = NULL;
+  stream->closing = false;
+
+  stream->out = (trace_output_t){
+    f, trace, stream->signals, stream->signal_count, NULL
+  };
+  backend->write_header(&stream->out);
+
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->cond, NULL);
+  if (pthread_create(&stream->writer, NULL, trace_stream_writer, stream)) {
+    perror("pthread_create()");
+    exit(EXIT_FAILURE);
+  }
+  return stream;
+}
 
-  free(psamples);
+/** Give the filled chunk to the writer, once it is done with the other */
+void trace_stream_flush(trace_stream_t *stream) {
+  trace_chunk_t *full = stream->fill;
+
+  pthread_mutex_lock(&stream->lock);
+  while (stream->pending)
+    pthread_cond_wait(&stream->cond, &stream->lock);
+  stream->pending = full;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+
+  stream->fill = full == &stream->chunks[0]
+    ? &stream->chunks[1] : &stream->chunks[0];
+  stream->fill->first_cycle = stream->cycle;
+  stream->fill->cycles = 0;
+}
 
-  fclose(f);
-  return true;
+void trace_stream_cycle(trace_stream_t *stream) {
+  assert (stream);
+
+  trace_chunk_t *chunk = stream->fill;
+  size_t row = chunk->cycles * stream->signal_count;
+
+  /* Take the last sample of each signal in this cycle. */
+  for (size_t i = 0; i < stream->signal_count; i++) {
+    buffer_t *samples = stream->signals[i]->samples;
+    size_t sz = trace_sizeof_signal_type(stream->signals[i]->type);
+
+    assert (sz <= TRACE_SAMPLE_SIZE);
+    chunk->present[row + i] = samples->occupancy >= sz;
+    if (chunk->present[row + i])
+      memcpy(chunk->samples + (row + i) * TRACE_SAMPLE_SIZE,
+             buffer_at(samples, samples->occupancy - sz), sz);
+    samples->occupancy = 0;
+  }
+
+  /* Signals missing from the header cannot be written. */
+  size_t signal_count = stream->trace->signals->occupancy
+    / sizeof(trace_signal_t *);
+  for (size_t i = stream->signal_count; i < signal_count; i++) {
+    trace_signal_t *sig = ((trace_signal_t **)stream->trace->signals->data)[i];
+    if (!stream->dropped)
+      fprintf(stderr, "[trace] signal %s appeared after the first cycle, "
+              "dropping it\n", sig->name);
+    stream->dropped = true;
+    sig->samples->occupancy = 0;
+  }
+
+  chunk->cycles++;
+  stream->cycle++;
+  if (chunk->cycles == stream->chunk_cycles)
+    trace_stream_flush(stream);
+}
+
+bool trace_stream_close(trace_stream_t *stream) {
+  assert (stream);
+
+  if (stream->fill->cycles)
+    trace_stream_flush(stream);
+
+  pthread_mutex_lock(&stream->lock);
+  stream->closing = true;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+  pthread_join(stream->writer, NULL);
+
+  stream->backend->write_footer(&stream->out);
+  bool ok = !ferror(stream->out.f);
+  ok = (fclose(stream->out.f) == 0) && ok;
+
+  pthread_cond_destroy(&stream->cond);
+  pthread_mutex_destroy(&stream->lock);
+  for (int i = 0; i < 2; i++) {
+    free(stream->chunks[i].samples);
+    free(stream->chunks[i].present);
+  }
+  free(stream->signals);
+  free(stream);
+  return ok;
 }
@@ -17,6 +17,10 @@ typedef struct trace_signal trace_signal_t;
 trace_signal_t *trace_signal_alloc(const char *name,
                                    trace_signal_type_t type,
                                    size_t initial_buffer_size);
+/* Ring signals only keep their last capacity samples, at constant memory. */
+trace_signal_t *trace_signal_alloc_ring(const char *name,
+                                        trace_signal_type_t type,
+                                        size_t capacity);
 void trace_signal_free(trace_signal_t *signal);
 
 void trace_add_samples(trace_signal_t *signal, void *samples, size_t count);
@@ -42,6 +46,21 @@ trace_signal_t *trace_file_lookup_signal(const trace_file_t *trace,
                                          const char *signal_name);
 bool trace_file_add_signal(const trace_file_t *trace, trace_signal_t *signal);
 
+/* The extension of file_name selects the backend: .vcd and .csv for text,
+   .htrc for the compact binary format of htrc.h. */
 bool trace_file_write(trace_file_t *, const char *file_name);
 
+/* Streams write the trace while it is being recorded, one cycle at a time,
+   from a writer thread, so that memory stays bounded. Each call to
+   trace_stream_cycle() ends a cycle, consuming the samples added to the
+   signals of the trace since the previous call. Cycles are numbered from
+   first_cycle on. */
+
+typedef struct trace_stream trace_stream_t;
+
+trace_stream_t *trace_stream_open(trace_file_t *, const char *file_name,
+                                  size_t chunk_cycles, size_t first_cycle);
+void trace_stream_cycle(trace_stream_t *);
+bool trace_stream_close(trace_stream_t *);
+
 #endif  /* TRACE_LIB_H */